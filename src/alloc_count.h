@@ -0,0 +1,39 @@
+// Counting malloc(), realloc() and calloc() for kilo_test.c and
+// kilo_bench.c. Include it first, then kilo.c: every allocation kilo.c
+// makes goes through the wrappers below and adds to allocCount. Undef
+// the three macros after kilo.c so that the harness' own allocations
+// aren't counted. The count is only exact while no worker runs.
+
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+static long allocCount = 0;
+
+static void *allocCountMalloc(size_t size) {
+    allocCount++;
+    return malloc(size);
+}
+
+static void *allocCountRealloc(void *p, size_t size) {
+    allocCount++;
+    return realloc(p, size);
+}
+
+static void *allocCountCalloc(size_t n, size_t size) {
+    allocCount++;
+    return calloc(n, size);
+}
+
+#define malloc(size) allocCountMalloc(size)
+#define realloc(p, size) allocCountRealloc(p, size)
+#define calloc(n, size) allocCountCalloc(n, size)
+
+// kilo.c asks for the same features itself
+#undef _GNU_SOURCE
+#undef _DEFAULT_SOURCE
+
+#endif
@@ -0,0 +1,39 @@
+// The editor kilo_test.c and kilo_bench.c work on. Include it after
+// kilo.c, once the alloc_count.h macros are undefined.
+
+#ifndef FIXTURE_H
+#define FIXTURE_H
+
+double fixtureNow() {
+    // Monotonic time in ms
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void fixtureInit() {
+    // The editor without a terminal: the screen gets a fixed size
+    editorInitState();
+    E.screenrows = 22;
+    E.screencols = 80;
+    editorScreenResize();
+}
+
+double fixtureOpen(const char *text, size_t len, const char *ext) {
+    // Open a file holding text, named with ext to pick the syntax.
+    // The file is removed right away: the mapping keeps its text
+    // around. Returns the ms editorOpen() took.
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/kilo_fixture_%d%s", (int)getpid(), ext);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL || fwrite(text, 1, len, fp) != len || fclose(fp) != 0) {
+        die("fixtureOpen::fwrite");
+    }
+    double t = fixtureNow();
+    editorOpen(path);
+    t = fixtureNow() - t;
+    unlink(path);
+    return t;
+}
+
+#endif
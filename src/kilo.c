@@ -9,18 +9,74 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define VERSION "0.0.1"
 #define TAB_STOP 8
+#define RX_CHECKPOINT 64
 #define QUIT_TIMES 3 // # of times required to quit without saving
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define INPUT_RING_SIZE (1 << 16) // Bytes read from the terminal, a power of 2
+#define ESC_TIMEOUT 100 // ms to wait for the rest of an escape sequence
+#define TIMER_SLOTS 256
+#define TIMER_TICK 10 // ms
+#define TIMER_NEXT_STALE -2 // E.timer_next has to be found again
+#define IDLE_MAX 8
+#define STATUS_TIMEOUT 5 // Seconds a status message stays
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
+// What the highlight cache of a row holds for its current text
+#define HL_CACHE_STATE (1<<0) // hl_open_comment, computed from hl_start
+#define HL_CACHE_HL (1<<1) // hl, computed from hl_start
+#define HL_CACHE_EXACT (1<<2) // hl_start was checked by the frontier
+// Rows looked at by the highlighter while drawing a frame (to catch
+// up with the viewport) and between keystrokes (to catch up with the
+// rest of the file). Rows further away are left to the workers.
+#define HL_SYNC_ROWS 2000
+#define HL_SLICE_ROWS 20000
+// Comment state transfer of a row or a leaf, as found by the highlight
+// workers: bit 0 is the state it ends with when starting outside of a
+// comment, bit 1 when starting inside one.
+#define HL_TF_VALID (1<<2)
+#define HL_JOB_LEAVES 64 // Leaves handed to a highlight worker at once
+#define HL_JOB_MIN_ROWS 16 // Fewer rows to scan in a loaded leaf are left to the main thread
+#define HL_START_PLAIN -1 // hl_start of a row drawn before its state was known
+#define SAVE_CHUNK (1 << 20) // Bytes written between two progress updates
+#define SAVE_IOV_BATCH 1024 // Most iovecs passed to one writev()
+#define SAVE_PROGRESS_MS 100
+#define UNDO_MAX_BYTES (64 << 20) // Memory the undo log may use
+#define FIND_JOB_LEAVES 64 // Leaves searched by one job
+#define RE_MAX_INSTS 4096 // Longest regex program
+#define RE_MAX_DEPTH 64 // Most nested groups
+#define RE_BODY 3 // Entry of the regex program for anchored matches
+#define RE_DFA_STATES 1024 // DFA states kept before starting over
+#define RE_DFA_HASH 2048 // Slots of the DFA state table, a power of 2
+#define RE_DFA_PCS (1 << 18) // Program counters kept in DFA states
+#define RE_ST_MATCH (1<<0) // A match ends here
+#define RE_ST_EOL (1<<1) // A match ends here if the line does
+#define RE_ST_BOL (1<<2) // Built at the start of a line
+#define RE_ST_DEAD (1<<3) // No match can go on from here
+#define HL_DIRTY_MAX 32 // Ranges of rows waiting for the highlighter
 
 // By setting the first const to 1000, the rest
 // get incrementing values of 1001/1002/1003 and so on.
@@ -35,6 +91,8 @@ enum editorKey {
     END_KEY,
     PAGE_UP,
     PAGE_DOWN,
+    PASTE_START, // <esc>[200~, the pasted text follows
+    PASTE_END
 };
 
 enum editorHighlight {
@@ -48,6 +106,62 @@ enum editorHighlight {
     HL_MATCH
 };
 
+// Row colors are stored as runs of chars with the same color, each
+// packed in a short: the length (1..HL_RUN_MAX) above HL_RUN_BITS
+// bits of color
+#define HL_RUN_BITS 4
+#define HL_RUN_COLOR ((1 << HL_RUN_BITS) - 1)
+#define HL_RUN_MAX ((1 << (16 - HL_RUN_BITS)) - 1)
+
+// Edits recorded in the undo log
+enum undoType {
+    UNDO_INSERT = 0, // Chars inserted in a row
+    UNDO_DELETE, // Chars deleted from a row
+    UNDO_INSERT_ROWS, // Rows inserted, each followed by '\n' in the text
+    UNDO_DELETE_ROWS
+};
+
+// What a key does to the undo groups, see editorUndoBoundary()
+enum undoKey {
+    UNDO_KEY_OTHER = 0,
+    UNDO_KEY_TYPE,
+    UNDO_KEY_BACKSPACE,
+    UNDO_KEY_DELETE
+};
+
+// A keyword list compiled into a perfect hash table, so looking
+// up an identifier costs one hash and at most one compare.
+struct keywordSlot {
+    const char *word;
+    unsigned char len; // 0 if the slot is empty
+    unsigned char hl; // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+struct keywordTable {
+    struct keywordSlot *slots;
+    unsigned int mask; // Number of slots - 1
+    unsigned int seed;
+    int minlen;
+    int maxlen;
+    unsigned char first[256]; // Characters a keyword can start with
+};
+
+// Character classes, one byte of flags per possible char value
+#define CC_SEPARATOR (1<<0) // Ends a word
+#define CC_SPACE (1<<1)
+#define CC_DIGIT (1<<2)
+#define CC_CONTROL (1<<3) // Drawn as ^X
+#define CC_STOP (1<<4) // May start a comment or a string in this syntax
+#define CC_KEYWORD (1<<5) // Some keyword starts with it
+
+struct charClasses {
+    unsigned char cls[256];
+    char stops[8]; // The CC_STOP chars
+    int nstops;
+    int simd_word; // [A-Za-z0-9_] are plain word chars
+    int simd_space; // ' ' is plain whitespace
+};
+
 // Store filetype syntax highlighting info
 struct editorSyntax {
     char *filetype;
@@ -57,19 +171,330 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct keywordTable *kwtable; // Built from keywords on first use
+    struct charClasses *cclass; // Likewise
+};
+
+// What only drawing a row and moving the cursor on it need: its
+// width, column checkpoints and colors. Kept apart from the erow and
+// made the first time it's needed (see editorRowView()), so sweeps
+// over all the rows don't pull it into the cache and rows that are
+// only searched or saved never get one. A row whose hl_cached has
+// HL_CACHE_HL always has one.
+struct rowView {
+    int *rxmap; // rx at every RX_CHECKPOINT-th char, see editorRowRxAt()
+    unsigned short *hl; // Color runs, see HL_RUN_BITS. NULL until highlighted
+    int rsize; // Columns taken once tabs are expanded
+    int rxvalid; // Leading entries of rxmap that are up to date
+    int rxcap;
+    int hlruns; // Runs in hl, they add up to size
+    int hlcap; // Bytes allocated for hl
+    int hl_from; // hl[hl_from..hl_to-1] is stale, if hl_from >= 0
+    int hl_to;
 };
 
-// Data type to store a row of text in our editor
+// Data type to store a row of text in our editor. Only what the
+// sweeps over rows read (saving, searching, finding comment states)
+// is kept here, packed so that a cache line holds more rows.
 typedef struct erow {
-    int idx;
     int size;
-    int rsize; // render size
-    char *render;
+    int cap; // Bytes allocated for chars, 0 while they are in the file mapping
     char *chars;
-    unsigned char *hl; // highlight
-    int hl_open_comment;
+    unsigned char mapped; // chars points into the file mapping and isn't ours to free
+    unsigned char hl_open_comment; // Inside a multi-line comment at the end of the row
+    signed char hl_start; // Inside a multi-line comment at the start of the row
+    unsigned char hl_cached; // HL_CACHE_* flags
+    unsigned char hl_tf; // Transfer of the row text, see HL_TF_VALID
+    struct rowView *view; // NULL until needed
 } erow;
 
+// Rows are kept in a counted B+tree (a rope of line chunks):
+// leaves hold up to ROWS_PER_LEAF consecutive rows, internal
+// nodes hold up to ROWS_FANOUT children and every node knows
+// how many rows live below it. Finding, inserting or deleting
+// row N is a single walk from the root to one leaf, so it costs
+// O(log n) however big the file is, plus a memmove inside one
+// small leaf. Nodes other than the root are kept at least a quarter
+// full, so a file that shrinks doesn't keep its old number of leaves.
+// Right after a file is opened, leaves only remember the slice of
+// the file mapping holding their lines (text/textlen) and rows is
+// NULL: the erow structs are built the first time a row of the leaf
+// is looked at.
+// Search jobs read the rows of leaves in place, without a lock. Rows
+// only ever move between leaves in rowTreeInsert() and rowTreeDelete(),
+// which first wait for the jobs reading the leaves they may change
+// (see rowTreeTouch()).
+#define ROWS_PER_LEAF 128
+#define ROWS_FANOUT 32
+#define ROWS_MAX_DEPTH 32
+
+typedef struct rowNode {
+    int leaf; // 1 if the node stores rows, 0 if it stores children
+    int count; // # of rows stored below this node
+    int n; // # of used entries in rows[] or child[]
+    struct rowNode *prev; // Leaves are chained in file order
+    struct rowNode *next;
+    erow *rows;
+    struct rowNode **child;
+    const char *text; // Lines of a leaf that hasn't been loaded yet
+    size_t textlen;
+    int text_cr; // text contains '\r', so lines can't be used as they are
+    int hl_in; // Comment state at the start and at the end of text,
+    int hl_out; // valid when hl_cached is set
+    int hl_cached;
+    int hl_tf; // Transfer of text, see HL_TF_VALID
+    unsigned int hl_job; // E.hl_gen of the highlight job queued for the leaf
+} rowNode;
+
+// Rows from..to-1 changed and their comment state must be checked
+// again, then the rows after them until one ends up with the state it
+// already had.
+struct hlRange {
+    int from;
+    int to;
+};
+
+// Walks the rows of the file in order without going back
+// to the root for every row.
+struct rowIter {
+    rowNode *leaf;
+    int slot;
+    int at; // Index of the current row
+};
+
+// Append buffer, growing by doubling its capacity so that
+// appending one byte at a time stays cheap
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+// Snapshot of a run of leaves handed to a highlight worker, which
+// fills in their comment state transfers (see editorSyntaxWorker())
+struct hlJob {
+    unsigned int gen; // E.hl_gen when the snapshot was taken
+    const struct editorSyntax *syntax;
+    int nleaves;
+    rowNode *leaf[HL_JOB_LEAVES]; // Only looked at by the main thread
+    const char *text[HL_JOB_LEAVES]; // Text of leaves not loaded, or NULL
+    size_t textlen[HL_JOB_LEAVES];
+    int out[HL_JOB_LEAVES]; // Transfer of the text of leaves not loaded
+    int first[HL_JOB_LEAVES + 1]; // Rows of loaded leaves in line[]
+    const char **line; // Chars of the rows of loaded leaves
+    int *linelen;
+    unsigned char *tf; // Transfer of each of those rows
+    char *copy; // Edited rows are copied: they may change meanwhile
+    struct hlJob *next;
+};
+
+// Snapshot of the file being saved by a worker: the text to write,
+// as pieces of the file mapping and of a copy of the edited rows
+struct saveJob {
+    char *path; // File to replace
+    mode_t mode; // Permissions to give it
+    uid_t uid; // Owner to give it, -1 for a new file
+    gid_t gid;
+    int inplace; // Overwrite the file instead of replacing it
+    struct iovec *iov;
+    int iovcnt;
+    int iovcap;
+    char *copy; // Edited rows, each followed by a newline
+    size_t total;
+    int dirty; // E.dirty when the snapshot was taken
+    pthread_mutex_t lock; // Protects the fields below
+    size_t written;
+    int done;
+    int err; // errno of the step that failed, 0 on success
+};
+
+enum reOp {
+    RE_SET = 0, // Consume a byte of a set
+    RE_SPLIT,
+    RE_JMP,
+    RE_BOL, // Only at the start of the line
+    RE_EOL, // Only at the end of the line
+    RE_MATCH
+};
+
+struct reInst {
+    unsigned char op; // reOp
+    int x; // RE_SET: index of the set; RE_SPLIT, RE_JMP: relative target
+    int y; // RE_SPLIT: second relative target
+};
+
+// Compiled regex: a program for a Thompson NFA (see reCompile())
+struct regex {
+    struct reInst *prog;
+    int n;
+    int cap;
+    uint32_t (*sets)[8]; // Bitmaps of the bytes each RE_SET takes
+    int nsets;
+    unsigned char cls[256]; // Bytes no set tells apart share a class
+    unsigned char rep[256]; // A byte of each class
+    int ncls;
+    const char *p; // Parser position
+    int depth;
+    int rev; // Built to match the text read right to left
+    const char *err; // Why the pattern was rejected
+    struct regex *back; // The same pattern with rev set
+};
+
+struct reState {
+    int off; // Program counters of the state, in reDfa.pcs
+    int n;
+    int flags; // RE_ST_*
+};
+
+// DFA run from a regex program. Each state is a set of program
+// counters of the NFA; states and transitions are only built when the
+// text gets to them, and all dropped when there are too many.
+struct reDfa {
+    const struct regex *re;
+    struct reState *st;
+    int nst;
+    int stcap;
+    int *pcs;
+    int npcs;
+    int pcscap;
+    int *next; // nst * re->ncls transitions, -1 until built
+    unsigned char *flags; // Flags of each state, for the scan loops
+    int *hash; // State + 1 in each slot, 0 if free
+    int start[4]; // Start states, anchored or not, at line start or not
+    // Where unanchored scans spend most of their time: the start state
+    // away from the line start. When only a few bytes leave it, scans
+    // skip to the next of them with syntaxFindAny().
+    int home; // -1 until looked at
+    char homeset[3];
+    int nhome; // -1 if more bytes leave the home state
+    int skiplines; // Lines without those bytes can't have a match
+    unsigned int flushes;
+    int *stack; // Scratch space for reClosure()
+    int *in;
+    int *out;
+    unsigned int *mark;
+    unsigned int gen;
+    struct reDfa *back; // DFA of re->back
+    unsigned char *starts; // Where matches start, see reSearch()
+    int startscap;
+};
+
+struct findMatch {
+    int row;
+    int col; // In chars
+    int len;
+};
+
+// A run of leaves searched by a worker for the query, and the
+// matches found in them. Rows aren't copied: edits wait for the jobs
+// reading the rows they change (see editorFindTouch() and
+// rowTreeTouch()).
+struct findJob {
+    unsigned int gen; // E.find.gen when it was queued
+    char *query;
+    int qlen;
+    int regex; // query is a regex
+    int nleaves;
+    const char *text[FIND_JOB_LEAVES]; // Text of leaves not loaded, or NULL
+    size_t textlen[FIND_JOB_LEAVES];
+    const erow *rows[FIND_JOB_LEAVES]; // Rows of loaded leaves
+    int n[FIND_JOB_LEAVES]; // # of rows of each leaf
+    int first_row;
+    struct findMatch *hits; // In file order
+    int nhits;
+    int cap;
+    int done; // Collected by the main thread
+    struct findJob *next;
+};
+
+// Incremental search. Every key typed in the prompt starts a new
+// query, which bumps gen: the jobs of the previous one stop at their
+// next leaf and are dropped when they come back. The matches of the
+// last query are kept in one sorted index, shown until ESC, and kept
+// up to date as rows are edited. Enter doesn't wait for the search
+// to finish: the jobs still out join the index as they come back.
+struct findState {
+    unsigned int gen;
+    pthread_mutex_t lock; // Protects gen and done
+    struct findJob *done;
+    struct findJob **jobs; // Jobs of the current query, in file order
+    int njobs;
+    int cap;
+    int known; // jobs[0..known-1] are back, their matches in the index
+    int shift; // Rows inserted minus deleted before the jobs not back
+    int stale; // Jobs of older queries not back yet
+    int open; // The prompt is open
+    int active; // There is a query, its matches are shown
+    char *query;
+    int use_regex; // The query is searched with re and dfa
+    struct regex re;
+    struct reDfa dfa; // Used by the main thread, to search edited rows
+    struct findMatch *match; // The index
+    int nmatch;
+    int matchcap;
+    int cur; // Match the prompt moved to, -1 until there is one
+    int wrap; // Stepped back from the first match, the last isn't in yet
+    // Rows edited since the index was last brought up to date: rows
+    // edit_from..edit_to-1 replace edit_to-edit_from-edit_delta rows
+    int edited;
+    int edit_from, edit_to, edit_delta;
+    int regex; // Ctrl-R in the prompt switches between literal and regex
+    const char *err; // Why the regex typed can't be used
+    char prompt[96];
+};
+
+// One edit in the undo log. Its text is in the arena of the log.
+struct undoOp {
+    unsigned char type; // undoType
+    unsigned int group; // Ops of a group are undone and redone together
+    int row;
+    int col; // For UNDO_INSERT and UNDO_DELETE
+    int n; // Rows, for UNDO_INSERT_ROWS and UNDO_DELETE_ROWS
+    int off; // Text of the op in the arena
+    int len;
+    int cx, cy; // Cursor before the group started
+    int ax, ay; // Cursor after the group, in its last op
+};
+
+// Ops in the order they were made. Undo walks back from `applied`,
+// redo forward. Text is kept in one arena, in the same order.
+struct undoLog {
+    struct undoOp *ops;
+    int nops;
+    int cap;
+    int applied; // ops[applied..nops-1] were undone and can be redone
+    struct abuf text;
+    unsigned int group; // Group new ops go to
+    unsigned int dropped; // Group that outgrew the log, not recorded
+    int key; // undoKey of the last key
+    int cx, cy; // Cursor when the group started
+    int replay; // Set while undoing or redoing: nothing is recorded
+};
+
+// Something to do later, see editorTimerAdd()
+struct editorTimer {
+    long long when; // editorNow() time it is due
+    void (*fn)(void);
+    int slot;
+    int armed;
+    struct editorTimer *next;
+};
+
+// Background work run when the editor has nothing else to do
+struct idleTask {
+    int (*pending)(void);
+    void (*run)(void); // Do a slice of the work and return
+};
+
+// A character cell of the screen, as drawn by the editor
+#define CELL_INVERSE (1<<0)
+
+typedef struct ecell {
+    char ch;
+    unsigned char hl; // Highlight class, giving the color
+    unsigned char attr;
+} ecell;
+
 struct editorConfig {
     struct termios orig_termios;
     int screenrows;
@@ -80,22 +505,121 @@ struct editorConfig {
     // row/col offset to keep track of what row the user is currently scrolled to
     int rowoff;
     int coloff;
-    erow *row;
+    rowNode *rowtree; // Root of the row storage
+    // The opened file is mapped in memory (or read in one go when
+    // it can't be mapped) and unedited rows point straight into it.
+    char *map;
+    size_t maplen;
+    int map_is_mmap;
     // dirty will tell us if the file has been modified since opening or saving
     int dirty;
     char *filename;
     char statusmsg[80]; // Status message
     struct editorSyntax *syntax;
+    // Sorted worklist of rows whose comment state must be checked.
+    // Rows before the first range (the highlight frontier) have an up
+    // to date state. Rows past it are highlighted with their best known
+    // state and checked again between keystrokes.
+    struct hlRange hl_dirty[HL_DIRTY_MAX];
+    int hl_ndirty;
+    int hl_redraw; // A row on screen turned out to be wrongly highlighted
+    // Rows ahead of the frontier are scanned by the worker pool from
+    // a snapshot of their text. Results are tagged with hl_gen, which
+    // every edit bumps, and dropped if they are not current.
+    unsigned int hl_gen;
+    int hl_jobs; // Jobs not collected yet, current or not
+    int hl_running; // Jobs the pool hasn't finished, for poolWait()
+    int hl_waiting; // The frontier reached a leaf a worker is scanning
+    pthread_mutex_t hl_lock; // Protects hl_done
+    struct hlJob *hl_done;
+    // Scratch space of editorUpdateSyntax(): the colors of a row, one
+    // per char, and the runs they are packed back into
+    unsigned char *hl_buf;
+    int hl_bufcap;
+    unsigned short *hl_runbuf;
+    int hl_runbufcap;
     time_t statusmsg_time; // Timestamp when status message was set
+    // Each frame is drawn into `screen`, then compared with `shadow`,
+    // a copy of what the terminal shows, and only the differences
+    // are sent. Both hold screenrows + 2 lines of screencols cells.
+    ecell *screen;
+    ecell *shadow;
+    int shadow_valid;
+    int shadow_rowoff; // Offsets the shadow was drawn with
+    int shadow_coloff;
+    int frame_bytes; // Bytes written to draw the last frame
+    struct abuf out; // Escapes of the frame being sent, reused every frame
+    // Input is read from the terminal in bulk into this ring,
+    // and decoded into keys from there.
+    char inbuf[INPUT_RING_SIZE];
+    unsigned int inhead, intail;
+    // Event loop: SIGWINCH is passed on through a pipe, so poll()
+    // wakes up for it like for input
+    int sigpipe[2];
+    int workpipe[2]; // Written by a worker when it has results to hand back
+    struct editorTimer *timers[TIMER_SLOTS];
+    long long timer_tick; // Last tick the timers were run for
+    long long timer_next; // Earliest time a timer is due, -1 if none
+    struct editorTimer msg_timer; // Clears the status message
+    struct idleTask idle[IDLE_MAX];
+    int nidle;
+    int idle_next;
+    int redraw; // Something on screen changed outside of a keypress
+    struct saveJob *save; // Save in progress, see editorSave()
+    int save_running; // For poolWait()
+    struct editorTimer save_timer; // Shows how far the save is
+    struct undoLog undo;
+    struct findState find;
 };
 
 struct editorConfig E;
 
-struct abuf {
-    char *b;
-    int len;
+// A fixed set of worker threads taking jobs from a queue,
+// used to spread heavy work (like indexing a big file)
+// over all the cores.
+#define POOL_MAX_THREADS 64
+
+struct poolJob {
+    void (*fn)(void *arg);
+    void *arg;
+    int *pending; // Counter of the batch the job belongs to
+    struct poolJob *next;
+};
+
+struct workerPool {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Signaled when a job is queued
+    pthread_cond_t done; // Broadcast when a job completes
+    struct poolJob *head;
+    struct poolJob *tail;
+    int nthreads;
+    pthread_t threads[POOL_MAX_THREADS];
+};
+
+struct workerPool pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    NULL, NULL, 0, {0}
+};
+
+// The chars and hl buffers of the rows come from size
+// classes carved out of big chunks: blocks have no header, a freed
+// block is reused by the next one of its class, and loading a leaf
+// costs a pointer bump per row instead of a malloc. Classes go by 8
+// bytes up to 128, then by quarters of a power of two up to
+// SLAB_MAX; bigger blocks come from malloc. Only the main thread
+// allocates rows, so there is no lock.
+#define SLAB_MAX 8192
+#define SLAB_CLASSES 40
+#define SLAB_CHUNK (1 << 20)
+
+struct rowSlab {
+    void *free[SLAB_CLASSES]; // Freed blocks, linked through their first bytes
+    char *next; // Unused part of the current chunk
+    char *end;
 };
 
+struct rowSlab slab;
+
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
 char *C_HL_keywords[] = {
     "switch", "if", "while", "for", "break", "continue", "return",
@@ -110,36 +634,96 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL, NULL
     },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 // Represents an empty buffer and acts as constructor
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 // Prototypes
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+struct rowView *editorRowView(erow *row);
+int editorSyntaxScan(const char *s, int len, int in_comment);
+void editorScreenResize();
+void editorScroll();
+void editorTimerAdd(struct editorTimer *t, int ms, void (*fn)(void));
+void editorTimerCancel(struct editorTimer *t);
+void editorWorkCollect();
+void editorFindRowChanged(int at);
+void editorFindRowInserted(int at);
+void editorFindRowDeleted(int at);
+void editorFindTouch(int at);
+void editorFindApplyEdits();
+void editorFindEnd();
+int reParseAlt(struct regex *re);
+
+int abReserve(struct abuf *ab, int len) {
+    // Make sure there is room for len more bytes, doubling the
+    // capacity as many times as needed. Returns -1 if out of memory.
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len) {
+            cap *= 2;
+        }
+        char *new = realloc(ab->b, cap);
+        if (new == NULL) {
+            return -1;
+        }
+        ab->b = new;
+        ab->cap = cap;
+    }
+    return 0;
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-    // Allocate enough memory to hold the previous string
-    // plus the new one.
-    char *new = realloc(ab->b, ab->len + len);
-
-    if (new == NULL) {
+    if (abReserve(ab, len) == -1) {
         return;
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+void abReset(struct abuf *ab) {
+    // Empty the buffer, keeping its memory for reuse
+    ab->len = 0;
+}
+
 void abFree(struct abuf *ab) {
     // Release memory
     free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+int writeAll(int fd, struct iovec *iov, int iovcnt) {
+    // writev() the buffers, carrying on after partial writes
+    // and interrupted calls. Returns -1 on error.
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
 }
 
 void die(const char *s) {
@@ -151,7 +735,174 @@ void die(const char *s) {
     exit(1);
 }
 
+void *poolWorker(void *unused) {
+    (void)unused;
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.head == NULL) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        struct poolJob *job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) {
+            pool.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&pool.lock);
+        job->fn(job->arg);
+        pthread_mutex_lock(&pool.lock);
+
+        if (job->pending) {
+            (*job->pending)--;
+        }
+        free(job);
+        pthread_cond_broadcast(&pool.done);
+    }
+    return NULL;
+}
+
+void poolInit(int nthreads) {
+    // Start the worker threads, once
+    if (pool.nthreads) {
+        return;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > POOL_MAX_THREADS) {
+        nthreads = POOL_MAX_THREADS;
+    }
+    for (int j = 0; j < nthreads; j++) {
+        if (pthread_create(&pool.threads[j], NULL, poolWorker, NULL) != 0) {
+            die("poolInit::pthread_create");
+        }
+        pool.nthreads++;
+    }
+}
+
+void poolSubmit(void (*fn)(void *), void *arg, int *pending) {
+    // Queue fn(arg). When given, *pending is increased now and
+    // decreased once the job has run (see poolWait()).
+    struct poolJob *job = malloc(sizeof(struct poolJob));
+    if (job == NULL) {
+        die("poolSubmit::malloc");
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->pending = pending;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    if (pending) {
+        (*pending)++;
+    }
+    if (pool.tail) {
+        pool.tail->next = job;
+    } else {
+        pool.head = job;
+    }
+    pool.tail = job;
+    pthread_cond_signal(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void poolWait(int *pending) {
+    // Wait for every job submitted with this counter to complete
+    pthread_mutex_lock(&pool.lock);
+    while (*pending > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int slabClass(size_t n) {
+    // Size class of an n bytes block, n <= SLAB_MAX
+    if (n <= 128) {
+        return n ? (n - 1) / 8 : 0;
+    }
+    int b = 31 - __builtin_clz(n - 1);
+    size_t base = (size_t)1 << b;
+    return 16 + (b - 7) * 4 + (n - 1 - base) / (base / 4);
+}
+
+size_t slabRound(size_t n) {
+    // Bytes really given for a block of n bytes: blocks are as big as
+    // their class, so callers can use the rest as spare capacity
+    if (n > SLAB_MAX) {
+        return n;
+    }
+    int k = slabClass(n);
+    if (k < 16) {
+        return (k + 1) * 8;
+    }
+    size_t base = (size_t)128 << ((k - 16) / 4);
+    return base + base / 4 * ((k - 16) % 4 + 1);
+}
+
+void *slabAlloc(size_t size) {
+    // Allocate a block of size bytes, as returned by slabRound()
+    if (size > SLAB_MAX) {
+        void *p = malloc(size);
+        if (p == NULL) {
+            die("slabAlloc::malloc");
+        }
+        return p;
+    }
+    int k = slabClass(size);
+    void *p = slab.free[k];
+    if (p) {
+        slab.free[k] = *(void **)p;
+        return p;
+    }
+    if (slab.next == NULL || (size_t)(slab.end - slab.next) < size) {
+        // The rest of the chunk is left unused: less than SLAB_MAX
+        slab.next = malloc(SLAB_CHUNK);
+        if (slab.next == NULL) {
+            die("slabAlloc::malloc");
+        }
+        slab.end = slab.next + SLAB_CHUNK;
+    }
+    p = slab.next;
+    slab.next += size;
+    return p;
+}
+
+void slabFree(void *p, size_t size) {
+    // Give back a block allocated with the given size
+    if (p == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX) {
+        free(p);
+        return;
+    }
+    int k = slabClass(size);
+    *(void **)p = slab.free[k];
+    slab.free[k] = p;
+}
+
+void *slabRealloc(void *p, size_t size, size_t newsize) {
+    // Resize a block, both sizes as returned by slabRound()
+    if (p && size == newsize) {
+        return p;
+    }
+    if (size > SLAB_MAX && newsize > SLAB_MAX) {
+        p = realloc(p, newsize);
+        if (p == NULL) {
+            die("slabRealloc::realloc");
+        }
+        return p;
+    }
+    void *q = slabAlloc(newsize);
+    if (p) {
+        memcpy(q, p, size < newsize ? size : newsize);
+        slabFree(p, size);
+    }
+    return q;
+}
+
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
         die("disableRawMode::tcsetattr");
     }
@@ -200,6 +951,10 @@ void enableRawMode() {
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         die("enableRawMode::tcsetattr");
     }
+
+    // Bracketed paste: the terminal sends pasted text between
+    // <esc>[200~ and <esc>[201~, so it can be inserted in one go
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -250,564 +1005,4867 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+size_t rowNextLine(const char *text, size_t len, size_t *linelen) {
+    // Find the line starting at text[0] and return the offset of the
+    // following one. Like getline() + the stripping editorOpen used to
+    // do, the trailing newline and carriage returns aren't part of it.
+    const char *nl = memchr(text, '\n', len);
+    size_t end = nl ? (size_t)(nl - text) : len;
+
+    *linelen = end;
+    while (*linelen > 0 && text[*linelen - 1] == '\r') {
+        (*linelen)--;
+    }
+    return nl ? end + 1 : len;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+#if defined(__AVX2__)
+// Bit masks of the newlines/carriage returns in the 64 bytes at p
+void scanBlock(const char *p, uint64_t *nl, uint64_t *cr) {
+    const __m256i vnl = _mm256_set1_epi8('\n');
+    const __m256i vcr = _mm256_set1_epi8('\r');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+
+    *nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vnl)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vnl)) << 32;
+    *cr = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vcr)) |
+        (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vcr)) << 32;
+}
+#elif defined(__SSE2__)
+void scanBlock(const char *p, uint64_t *nl, uint64_t *cr) {
+    const __m128i vnl = _mm_set1_epi8('\n');
+    const __m128i vcr = _mm_set1_epi8('\r');
+    *nl = 0;
+    *cr = 0;
+    for (int k = 0; k < 4; k++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + k * 16));
+        *nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vnl)) << (k * 16);
+        *cr |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vcr)) << (k * 16);
+    }
+}
+#endif
+
+const char *scanLines(const char *p, const char *end, int want, int *found, int *cr) {
+    // Skip up to `want` lines starting at p and return where the next
+    // one starts (or end). *found is set to the number of lines ended
+    // by a newline that were skipped, and *cr to 1 if a '\r' was seen.
+    // With SSE2/AVX2 the text is checked 64 bytes at a time: vector
+    // compares give a bit mask of the newlines in the block, and a
+    // popcount tells if the line we want ends in there.
+    int n = 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    while (end - p >= 64) {
+        uint64_t nl, crs;
+        scanBlock(p, &nl, &crs);
+
+        int count = __builtin_popcountll(nl);
+        if (n + count >= want) {
+            // Drop the newlines before the one we want
+            for (int k = want - n - 1; k > 0; k--) {
+                nl &= nl - 1;
+            }
+            int bit = __builtin_ctzll(nl);
+            if (bit < 63) {
+                crs &= ((uint64_t)2 << bit) - 1;
+            }
+            if (crs) {
+                *cr = 1;
+            }
+            *found = want;
+            return p + bit + 1;
+        }
+        if (crs) {
+            *cr = 1;
+        }
+        n += count;
+        p += 64;
+    }
+#endif
+
+    // Whatever is left (or everything, without SIMD)
+    for (; p < end; p++) {
+        if (*p == '\r') {
+            *cr = 1;
+        } else if (*p == '\n' && ++n == want) {
+            *found = n;
+            return p + 1;
+        }
+    }
+    *found = n;
+    return end;
+}
 
-    // No highlighting required
-    if (E.syntax == NULL) {
-        return;
+void rowLeafLoad(rowNode *leaf) {
+    // Build the erow structs of a leaf that only knows its slice of
+    // the file. Rows keep pointing into the mapping until edited.
+    leaf->rows = malloc(sizeof(erow) * ROWS_PER_LEAF);
+    if (leaf->rows == NULL) {
+        die("rowLeafLoad::malloc");
     }
 
-    char **keywords = E.syntax->keywords;
+    size_t off = 0;
+    for (int j = 0; j < leaf->n; j++) {
+        erow *row = &leaf->rows[j];
+        size_t linelen;
+        size_t next = rowNextLine(&leaf->text[off], leaf->textlen - off, &linelen);
+
+        row->size = linelen;
+        row->chars = (char *)&leaf->text[off];
+        row->mapped = 1;
+        row->cap = 0;
+        row->view = NULL;
+        row->hl_open_comment = 0;
+        row->hl_start = 0;
+        row->hl_cached = 0;
+        row->hl_tf = 0;
+
+        // Keep the comment states already found for the leaf
+        if (leaf->hl_cached) {
+            row->hl_start = j > 0 ? leaf->rows[j - 1].hl_open_comment : leaf->hl_in;
+            row->hl_open_comment = editorSyntaxScan(row->chars, row->size, row->hl_start);
+            row->hl_cached = HL_CACHE_STATE | HL_CACHE_EXACT;
+        }
+        off += next;
+    }
+    leaf->text = NULL;
+    leaf->textlen = 0;
+}
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+rowNode *rowNodeNew(int leaf) {
+    rowNode *node = calloc(1, sizeof(rowNode));
+    if (node == NULL) {
+        die("rowNodeNew::calloc");
+    }
+    node->leaf = leaf;
+    if (leaf) {
+        node->rows = malloc(sizeof(erow) * ROWS_PER_LEAF);
+    } else {
+        node->child = malloc(sizeof(rowNode *) * ROWS_FANOUT);
+    }
+    if (node->rows == NULL && node->child == NULL) {
+        die("rowNodeNew::malloc");
+    }
+    return node;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+void rowNodeFree(rowNode *node) {
+    // Unchain the leaf before releasing it
+    if (node->leaf) {
+        if (node->prev) {
+            node->prev->next = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        }
+    }
+    free(node->rows);
+    free(node->child);
+    free(node);
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+int rowNodeIsFull(rowNode *node) {
+    return node->n == (node->leaf ? ROWS_PER_LEAF : ROWS_FANOUT);
+}
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+int rowNodeIsLow(rowNode *node) {
+    // Below a quarter full: time to merge with a sibling or borrow
+    return node->n < (node->leaf ? ROWS_PER_LEAF : ROWS_FANOUT) / 4;
+}
 
-        // Check if it's a single line comment
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+void rowNodeSplitChild(rowNode *parent, int ci) {
+    // Move the upper half of parent->child[ci] into a new sibling
+    // placed right after it.
+    // The parent must not be full.
+    rowNode *full = parent->child[ci];
+    rowNode *sib = rowNodeNew(full->leaf);
+    int half = full->n / 2;
 
-        // Check if it's a multi-line comment
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
+    if (full->leaf && full->rows == NULL) {
+        rowLeafLoad(full);
+    }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) {
-                    in_string = 0;
-                }
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
+    sib->n = full->n - half;
+    if (full->leaf) {
+        memcpy(sib->rows, &full->rows[half], sizeof(erow) * sib->n);
+        sib->count = sib->n;
+
+        sib->prev = full;
+        sib->next = full->next;
+        if (full->next) {
+            full->next->prev = sib;
         }
-        // Check if numbers should be highlighted for current filetype
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+        full->next = sib;
+    } else {
+        memcpy(sib->child, &full->child[half], sizeof(rowNode *) * sib->n);
+        for (int j = 0; j < sib->n; j++) {
+            sib->count += sib->child[j]->count;
         }
+    }
+    full->n = half;
+    full->count -= sib->count;
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
+    memmove(&parent->child[ci + 2], &parent->child[ci + 1], sizeof(rowNode *) * (parent->n - ci - 1));
+    parent->child[ci + 1] = sib;
+    parent->n++;
+}
 
-                if (kw2) {
-                    klen--;
-                }
+rowNode *rowTreeLocate(int at, int *slot) {
+    // Return the leaf holding row `at` and its position in that leaf
+    rowNode *node = E.rowtree;
+    if (node == NULL || at < 0 || at >= node->count) {
+        return NULL;
+    }
 
-                if (!strncmp(&row->render[i], keywords[j], klen) && is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->child[i]->count) {
+            at -= node->child[i]->count;
+            i++;
         }
-
-        prev_sep = is_separator(c);
-        i++;
+        node = node->child[i];
     }
-
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
-    } 
+    *slot = at;
+    return node;
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT:
-            return 36;
-        case HL_KEYWORD1:
-            return 33;
-        case HL_KEYWORD2:
-            return 32;
-        case HL_STRING:
-            return 35;
-        case HL_NUMBER:
-            return 31;
-        case HL_MATCH:
-            return 34;
-        default:
-            return 37;
+rowNode *rowTreeFind(int at, int *slot) {
+    // Like rowTreeLocate(), loading the leaf from the file mapping
+    // if needed.
+    rowNode *node = rowTreeLocate(at, slot);
+    if (node && node->rows == NULL) {
+        rowLeafLoad(node);
     }
+    return node;
 }
 
-void editorSelectSyntaxHighlight() {
+void rowTreeTouch(int at, int n, int insert) {
+    // Rows at..at+n-1 are about to be inserted or deleted. An insert
+    // changes the leaf they go in, a delete may also merge the leaf of
+    // the last one with the next leaf or move rows between them (see
+    // rowNodeRefill()): wait for the search jobs reading any of them,
+    // then let the search index know of the edit.
+    int last = at;
+    int slot;
+    rowNode *leaf = insert ? NULL : rowTreeLocate(at + n - 1, &slot);
+    if (leaf && leaf->next) {
+        last = at + n - 1 - slot + leaf->n + leaf->next->n - 1;
+    }
+    editorFindTouch(last);
+    for (int j = 0; j < n; j++) {
+        if (insert) {
+            editorFindRowInserted(at + j);
+        } else {
+            editorFindRowDeleted(at);
+        }
+    }
+}
+
+erow *rowTreeInsert(int at) {
+    // Make room for a new row at position `at` and return it.
+    // Full nodes are split on the way down, so there is always
+    // room in the leaf we end up in.
+    rowTreeTouch(at, 1, 1);
+    if (E.rowtree == NULL) {
+        E.rowtree = rowNodeNew(1);
+    }
+    if (rowNodeIsFull(E.rowtree)) {
+        rowNode *root = rowNodeNew(0);
+        root->child[0] = E.rowtree;
+        root->n = 1;
+        root->count = E.rowtree->count;
+        rowNodeSplitChild(root, 0);
+        E.rowtree = root;
+    }
+
+    rowNode *node = E.rowtree;
+    while (!node->leaf) {
+        node->count++;
+        int i = 0;
+        while (i < node->n - 1 && at > node->child[i]->count) {
+            at -= node->child[i]->count;
+            i++;
+        }
+        if (rowNodeIsFull(node->child[i])) {
+            rowNodeSplitChild(node, i);
+            if (at > node->child[i]->count) {
+                at -= node->child[i]->count;
+                i++;
+            }
+        }
+        node = node->child[i];
+    }
+    if (node->rows == NULL) {
+        rowLeafLoad(node);
+    }
+
+    memmove(&node->rows[at + 1], &node->rows[at], sizeof(erow) * (node->n - at));
+    node->n++;
+    node->count++;
+    return &node->rows[at];
+}
+
+void rowNodeShift(rowNode *left, rowNode *right, int k) {
+    // Move k entries from the front of right to the end of left, or
+    // -k entries from the end of left to the front of right, when k is
+    // negative. Both nodes are siblings, leaves loaded.
+    int moved = 0;
+    if (k > 0) {
+        if (left->leaf) {
+            memcpy(&left->rows[left->n], right->rows, sizeof(erow) * k);
+            memmove(right->rows, &right->rows[k], sizeof(erow) * (right->n - k));
+            moved = k;
+        } else {
+            memcpy(&left->child[left->n], right->child, sizeof(rowNode *) * k);
+            memmove(right->child, &right->child[k], sizeof(rowNode *) * (right->n - k));
+            for (int j = 0; j < k; j++) {
+                moved += left->child[left->n + j]->count;
+            }
+        }
+    } else {
+        k = -k;
+        if (left->leaf) {
+            memmove(&right->rows[k], right->rows, sizeof(erow) * right->n);
+            memcpy(right->rows, &left->rows[left->n - k], sizeof(erow) * k);
+            moved = -k;
+        } else {
+            memmove(&right->child[k], right->child, sizeof(rowNode *) * right->n);
+            memcpy(right->child, &left->child[left->n - k], sizeof(rowNode *) * k);
+            for (int j = 0; j < k; j++) {
+                moved -= right->child[j]->count;
+            }
+        }
+        k = -k;
+    }
+    left->n += k;
+    right->n -= k;
+    left->count += moved;
+    right->count -= moved;
+}
+
+int rowNodeJoin(rowNode *left, rowNode *right) {
+    // Merge right into its left sibling when both fit in one node, or
+    // else even them out. Returns 1 if right was merged, and freed.
+    if (left->leaf) {
+        if (left->rows == NULL) {
+            rowLeafLoad(left);
+        }
+        if (right->rows == NULL) {
+            rowLeafLoad(right);
+        }
+    }
+    if (left->n + right->n <= (left->leaf ? ROWS_PER_LEAF : ROWS_FANOUT)) {
+        rowNodeShift(left, right, right->n);
+        rowNodeFree(right);
+        return 1;
+    }
+    rowNodeShift(left, right, (right->n - left->n) / 2);
+    return 0;
+}
+
+void rowNodeRefill(rowNode *parent, int ci) {
+    // parent->child[ci] fell below a quarter full: merge it with a
+    // sibling when both fit in one node, or else even them out, so
+    // that deleting rows doesn't leave a trail of nearly empty leaves
+    // behind. With no sibling, only an empty child is dropped.
+    if (parent->n == 1) {
+        if (parent->child[0]->n == 0) {
+            rowNodeFree(parent->child[0]);
+            parent->n = 0;
+        }
+        return;
+    }
+    int li = ci > 0 ? ci - 1 : ci;
+    if (rowNodeJoin(parent->child[li], parent->child[li + 1])) {
+        memmove(&parent->child[li + 1], &parent->child[li + 2], sizeof(rowNode *) * (parent->n - li - 2));
+        parent->n--;
+    }
+}
+
+void rowTreeDelete(int at) {
+    // Remove row `at`. The caller releases its memory afterwards: a
+    // search job may still be reading it until rowTreeTouch() returns.
+    rowTreeTouch(at, 1, 0);
+    rowNode *path[ROWS_MAX_DEPTH];
+    int pathidx[ROWS_MAX_DEPTH];
+    int depth = 0;
+
+    rowNode *node = E.rowtree;
+    while (!node->leaf) {
+        node->count--;
+        int i = 0;
+        while (at >= node->child[i]->count) {
+            at -= node->child[i]->count;
+            i++;
+        }
+        path[depth] = node;
+        pathidx[depth] = i;
+        depth++;
+        node = node->child[i];
+    }
+    if (node->rows == NULL) {
+        rowLeafLoad(node);
+    }
+
+    memmove(&node->rows[at], &node->rows[at + 1], sizeof(erow) * (node->n - at - 1));
+    node->n--;
+    node->count--;
+
+    // Refill nodes left too small from a sibling, going up as long as
+    // that makes their parent too small in turn, then collapse a root
+    // with a single child
+    while (rowNodeIsLow(node) && depth > 0) {
+        depth--;
+        rowNode *parent = path[depth];
+        rowNodeRefill(parent, pathidx[depth]);
+        node = parent;
+    }
+    if (!E.rowtree->leaf && E.rowtree->n == 0) {
+        rowNodeFree(E.rowtree);
+        E.rowtree = NULL;
+    }
+    while (E.rowtree && !E.rowtree->leaf && E.rowtree->n == 1) {
+        rowNode *old = E.rowtree;
+        E.rowtree = old->child[0];
+        rowNodeFree(old);
+    }
+}
+
+erow *editorRowAt(int at) {
+    // Return the row at index `at`, or NULL past the end of the file.
+    // The pointer is only valid until the next row insert/delete.
+    int slot;
+    rowNode *leaf = rowTreeFind(at, &slot);
+    return leaf ? &leaf->rows[slot] : NULL;
+}
+
+erow *editorRowPeek(int at) {
+    // Like editorRowAt() but return NULL instead of loading the row
+    int slot;
+    rowNode *leaf = rowTreeLocate(at, &slot);
+    return (leaf && leaf->rows) ? &leaf->rows[slot] : NULL;
+}
+
+erow *editorRowIterStart(struct rowIter *it, int at) {
+    it->at = at;
+    it->leaf = rowTreeFind(at, &it->slot);
+    return it->leaf ? &it->leaf->rows[it->slot] : NULL;
+}
+
+erow *editorRowIterNext(struct rowIter *it) {
+    if (it->leaf == NULL) {
+        return NULL;
+    }
+    it->at++;
+    it->slot++;
+    if (it->slot >= it->leaf->n) {
+        it->leaf = it->leaf->next;
+        it->slot = 0;
+        if (it->leaf == NULL) {
+            return NULL;
+        }
+        if (it->leaf->rows == NULL) {
+            rowLeafLoad(it->leaf);
+        }
+    }
+    return &it->leaf->rows[it->slot];
+}
+
+rowNode *rowTreeFirstLeaf() {
+    rowNode *node = E.rowtree;
+    while (node && !node->leaf) {
+        node = node->child[0];
+    }
+    return node;
+}
+
+int rowTreeGroup(rowNode **nodes, int n) {
+    // Put the given nodes (in file order) under new parents, full but
+    // for the last two, which share what is left when the last one
+    // would be less than a quarter full. The parents replace the nodes
+    // in `nodes`, their number is returned.
+    int parents = 0;
+    for (int j = 0; j < n; ) {
+        int size = ROWS_FANOUT;
+        if (n - j > ROWS_FANOUT && n - j - ROWS_FANOUT < ROWS_FANOUT / 4) {
+            size = (n - j) / 2;
+        }
+        rowNode *parent = rowNodeNew(0);
+        while (parent->n < size && j + parent->n < n) {
+            rowNode *child = nodes[j + parent->n];
+            parent->child[parent->n++] = child;
+            parent->count += child->count;
+        }
+        j += parent->n;
+        nodes[parents++] = parent;
+    }
+    return parents;
+}
+
+void rowTreeBuild(rowNode **nodes, int n) {
+    // Stack the given leaves (in file order) under as many levels
+    // of internal nodes as needed and make the result the row tree.
+    // `nodes` is reused to hold each level.
+    if (n == 0) {
+        E.rowtree = NULL;
+        return;
+    }
+    for (int j = 0; j < n; j++) {
+        nodes[j]->prev = j > 0 ? nodes[j - 1] : NULL;
+        nodes[j]->next = j < n - 1 ? nodes[j + 1] : NULL;
+    }
+    while (n > 1) {
+        n = rowTreeGroup(nodes, n);
+    }
+    E.rowtree = nodes[0];
+}
+
+int rowTreePath(int at, rowNode **path, int *idx) {
+    // Fill in the nodes from the root down to the leaf holding row
+    // `at`, and the index of each one in its parent: path[d + 1] is
+    // path[d]->child[idx[d]]. Returns the depth of the leaf.
+    rowNode *node = E.rowtree;
+    int depth = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && at >= node->child[i]->count) {
+            at -= node->child[i]->count;
+            i++;
+        }
+        path[depth] = node;
+        idx[depth] = i;
+        depth++;
+        node = node->child[i];
+    }
+    path[depth] = node;
+    return depth;
+}
+
+int rowTreePathStep(rowNode **path, int *idx, int depth, int dir) {
+    // Move path[depth] to the node before it (dir -1) or after it
+    // (dir 1) at the same depth, the nodes above following. Returns 0,
+    // leaving the path as it was, at the edge of the tree.
+    if (depth == 0) {
+        return 0;
+    }
+    int i = idx[depth - 1] + dir;
+    if (i < 0 || i >= path[depth - 1]->n) {
+        if (!rowTreePathStep(path, idx, depth - 1, dir)) {
+            return 0;
+        }
+        i = dir > 0 ? 0 : path[depth - 1]->n - 1;
+    }
+    idx[depth - 1] = i;
+    path[depth] = path[depth - 1]->child[i];
+    return 1;
+}
+
+void rowTreeSplice(rowNode **pathl, int *idxl, rowNode **pathr, int *idxr, int depth,
+    rowNode *start, rowNode *end) {
+    // The leaves from pathl[depth] to pathr[depth] were replaced by
+    // the chain of leaves from start up to end (not included), none
+    // of them low unless it's the only leaf left. Going up a level at
+    // a time, the parents of the nodes replaced go too: what else they
+    // held is put with the new nodes under new parents, pulling in the
+    // node next to them when that is less than a quarter of a node.
+    // Everything else in the tree stays as it is, counts included.
+    int n = 0;
+    for (rowNode *leaf = start; leaf != end; leaf = leaf->next) {
+        n++;
+    }
+    rowNode **nodes = malloc(sizeof(rowNode *) * (n + 5 * ROWS_FANOUT));
+    if (nodes == NULL) {
+        die("rowTreeSplice::malloc");
+    }
+    n = 0;
+    for (rowNode *leaf = start; leaf != end; leaf = leaf->next) {
+        nodes[n++] = leaf;
+    }
+
+    for (int d = depth - 1; d >= 0; d--) {
+        rowNode *left[2 * ROWS_FANOUT], *right[2 * ROWS_FANOUT];
+        int nleft = idxl[d];
+        int nright = pathr[d]->n - idxr[d] - 1;
+        memcpy(left, pathl[d]->child, sizeof(rowNode *) * nleft);
+        memcpy(right, &pathr[d]->child[idxr[d] + 1], sizeof(rowNode *) * nright);
+        if (d > 0 && nleft + n + nright < ROWS_FANOUT / 4) {
+            if (rowTreePathStep(pathl, idxl, d, -1)) {
+                rowNode *sib = pathl[d];
+                memmove(&left[sib->n], left, sizeof(rowNode *) * nleft);
+                memcpy(left, sib->child, sizeof(rowNode *) * sib->n);
+                nleft += sib->n;
+            } else if (rowTreePathStep(pathr, idxr, d, 1)) {
+                rowNode *sib = pathr[d];
+                memcpy(&right[nright], sib->child, sizeof(rowNode *) * sib->n);
+                nright += sib->n;
+            }
+        }
+
+        // Free the old parents, walking from the first to the last
+        rowNode *path[ROWS_MAX_DEPTH + 1];
+        int idx[ROWS_MAX_DEPTH];
+        memcpy(path, pathl, sizeof(rowNode *) * (d + 1));
+        memcpy(idx, idxl, sizeof(int) * d);
+        while (1) {
+            rowNode *old = path[d];
+            rowNodeFree(old);
+            if (old == pathr[d]) {
+                break;
+            }
+            rowTreePathStep(path, idx, d, 1);
+        }
+
+        memmove(&nodes[nleft], nodes, sizeof(rowNode *) * n);
+        memcpy(nodes, left, sizeof(rowNode *) * nleft);
+        memcpy(&nodes[nleft + n], right, sizeof(rowNode *) * nright);
+        n = rowTreeGroup(nodes, nleft + n + nright);
+    }
+
+    // What replaces the root may need levels on top, or be a single
+    // child to collapse
+    while (n > 1) {
+        n = rowTreeGroup(nodes, n);
+    }
+    E.rowtree = n ? nodes[0] : NULL;
+    free(nodes);
+    while (E.rowtree && !E.rowtree->leaf && E.rowtree->n == 1) {
+        rowNode *old = E.rowtree;
+        E.rowtree = old->child[0];
+        rowNodeFree(old);
+    }
+}
+
+void rowTreeDeleteRows(int at, int n) {
+    // Remove rows at..at+n-1 at once (the caller releases their memory
+    // afterwards). The leaves between the first and the last of them
+    // go whole, those two are cut and put together, then the nodes
+    // above them are built again: one pass over the leaves instead of
+    // n walks down the tree, each of which may refill nodes.
+    rowTreeTouch(at, n, 0);
+    int s1, s2;
+    rowNode *head = rowTreeFirstLeaf();
+    rowNode *first = rowTreeFind(at, &s1);
+    rowNode *last = rowTreeFind(at + n - 1, &s2);
+    // The leaves on either side may be joined with them too
+    rowNode *pathl[ROWS_MAX_DEPTH + 1], *pathr[ROWS_MAX_DEPTH + 1];
+    int idxl[ROWS_MAX_DEPTH], idxr[ROWS_MAX_DEPTH];
+    int depth = rowTreePath(first->prev ? at - s1 - 1 : at, pathl, idxl);
+    rowTreePath(last->next ? at + n - 1 - s2 + last->n : at + n - 1, pathr, idxr);
+    rowNode *before = pathl[depth]->prev;
+    rowNode *after = pathr[depth]->next;
+
+    while (first != last && first->next != last) {
+        rowNodeFree(first->next);
+    }
+    if (first == last) {
+        memmove(&first->rows[s1], &first->rows[s2 + 1], sizeof(erow) * (first->n - s2 - 1));
+        first->n -= n;
+    } else {
+        first->n = s1;
+        memmove(last->rows, &last->rows[s2 + 1], sizeof(erow) * (last->n - s2 - 1));
+        last->n -= s2 + 1;
+        last->count = last->n;
+        if (rowNodeIsLow(first) || rowNodeIsLow(last)) {
+            rowNodeJoin(first, last);
+        }
+    }
+    first->count = first->n;
+
+    // What is left of the first leaf may still be low: refill it from
+    // the leaf after it, or before it at the end of the file
+    if (rowNodeIsLow(first) && first->next) {
+        rowNodeJoin(first, first->next);
+    } else if (rowNodeIsLow(first) && first->prev) {
+        rowNodeJoin(first->prev, first);
+    } else if (first->n == 0) {
+        rowNodeFree(first);
+        head = NULL;
+    }
+    rowTreeSplice(pathl, idxl, pathr, idxr, depth, before ? before->next : head, after);
+}
+
+void rowTreeInsertRows(int at, int n) {
+    // Make room for n rows at position `at` at once, for the caller
+    // to fill in. The rows of the leaf from `at` on move past them and
+    // the leaf is followed by as many full new leaves as needed, then
+    // the nodes above it are built again.
+    rowTreeTouch(at, n, 1);
+    if (E.rowtree == NULL) {
+        E.rowtree = rowNodeNew(1);
+    }
+    rowNode *pathl[ROWS_MAX_DEPTH + 1], *pathr[ROWS_MAX_DEPTH + 1];
+    int idxl[ROWS_MAX_DEPTH], idxr[ROWS_MAX_DEPTH];
+    int slot = 0;
+    rowNode *leaf = E.rowtree;
+    if (at > 0 && at == E.rowtree->count) {
+        leaf = rowTreeFind(at - 1, &slot);
+        slot++;
+    } else if (at > 0 || E.rowtree->count > 0) {
+        leaf = rowTreeFind(at, &slot);
+    }
+    // The last leaf may be joined with the one before
+    int depth = rowTreePath(leaf->prev ? at - slot - 1 : at - slot, pathl, idxl);
+    rowTreePath(at - slot, pathr, idxr);
+    rowNode *start = pathl[depth];
+    rowNode *after = leaf->next;
+
+    int ntail = leaf->n - slot;
+    erow *tail = malloc(sizeof(erow) * (ntail + 1));
+    if (tail == NULL) {
+        die("rowTreeInsertRows::malloc");
+    }
+    memcpy(tail, &leaf->rows[slot], sizeof(erow) * ntail);
+    leaf->n = slot;
+    for (int k = 0; k < n + ntail; k++) {
+        if (leaf->n == ROWS_PER_LEAF) {
+            leaf->count = leaf->n;
+            rowNode *sib = rowNodeNew(1);
+            sib->prev = leaf;
+            sib->next = leaf->next;
+            if (leaf->next) {
+                leaf->next->prev = sib;
+            }
+            leaf->next = sib;
+            leaf = sib;
+        }
+        if (k >= n) {
+            leaf->rows[leaf->n] = tail[k - n];
+        }
+        leaf->n++;
+    }
+    leaf->count = leaf->n;
+    free(tail);
+    if (rowNodeIsLow(leaf) && leaf->prev) {
+        rowNodeJoin(leaf->prev, leaf);
+    }
+    rowTreeSplice(pathl, idxl, pathr, idxr, depth, start, after);
+}
+
+// Classes of chars when no syntax is selected
+struct charClasses charClassBase;
+
+void editorCharClassInit(struct charClasses *cc, struct editorSyntax *s) {
+    // Fill in the class table, for syntax s if not NULL
+    memset(cc, 0, sizeof(*cc));
+    for (int c = 0; c < 256; c++) {
+        if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL) {
+            cc->cls[c] |= CC_SEPARATOR;
+        }
+        if (isspace(c)) {
+            cc->cls[c] |= CC_SPACE;
+        }
+        if (isdigit(c)) {
+            cc->cls[c] |= CC_DIGIT;
+        }
+        if (iscntrl(c)) {
+            cc->cls[c] |= CC_CONTROL;
+        }
+    }
+    if (s == NULL) {
+        return;
+    }
+
+    char *starts[] = { s->singleline_comment_start, s->multiline_comment_start, "\"", "'" };
+    int nstarts = s->flags & HL_HIGHLIGHT_STRINGS ? 4 : 2;
+    for (int j = 0; j < nstarts; j++) {
+        unsigned char c = starts[j] ? starts[j][0] : 0;
+        if (c && !(cc->cls[c] & CC_STOP)) {
+            cc->cls[c] |= CC_STOP;
+            cc->stops[cc->nstops++] = c;
+        }
+    }
+    for (int j = 0; s->keywords && s->keywords[j]; j++) {
+        cc->cls[(unsigned char)s->keywords[j][0]] |= CC_KEYWORD;
+    }
+
+    cc->simd_word = 1;
+    for (int c = 0; c < 256; c++) {
+        if ((isalnum(c) || c == '_') && (cc->cls[c] & (CC_SEPARATOR | CC_STOP))) {
+            cc->simd_word = 0;
+        }
+    }
+    cc->simd_space = (cc->cls[' '] & (CC_SPACE | CC_STOP | CC_KEYWORD)) == CC_SPACE;
+}
+
+// The highlighters spend most of their time going over runs of
+// chars that don't change their state. These find where such a run
+// ends; with SSE2 they check 16 bytes at a time when they can.
+
+int syntaxSkipWord(const struct charClasses *cc, const char *s, int i, int len) {
+    // Skip chars that are neither separators nor start a comment/string
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (cc->simd_word) {
+        const __m128i az = _mm_set1_epi8((char)(128 - 'a'));
+        const __m128i n09 = _mm_set1_epi8((char)(128 - '0'));
+        const __m128i under = _mm_set1_epi8('_');
+        const __m128i lim26 = _mm_set1_epi8(-128 + 26);
+        const __m128i lim10 = _mm_set1_epi8(-128 + 10);
+        const __m128i bit5 = _mm_set1_epi8(0x20);
+        while (len - i >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+            // Unsigned range checks, done as signed compares after
+            // moving the range to the bottom of the signed bytes
+            __m128i alpha = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(v, bit5), az), lim26);
+            __m128i digit = _mm_cmplt_epi8(_mm_add_epi8(v, n09), lim10);
+            __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(v, under));
+            unsigned int mask = ~_mm_movemask_epi8(word) & 0xffff;
+            if (mask) {
+                i += __builtin_ctz(mask);
+                break;
+            }
+            i += 16;
+        }
+    }
+#endif
+    while (i < len && !(cc->cls[(unsigned char)s[i]] & (CC_SEPARATOR | CC_STOP))) {
+        i++;
+    }
+    return i;
+}
+
+int syntaxSkipSpace(const struct charClasses *cc, const char *s, int i, int len) {
+    // Skip whitespace that can't start a comment, string or keyword
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (cc->simd_space) {
+        const __m128i sp = _mm_set1_epi8(' ');
+        while (len - i >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+            unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)) & 0xffff;
+            if (mask) {
+                i += __builtin_ctz(mask);
+                break;
+            }
+            i += 16;
+        }
+    }
+#endif
+    while (i < len && (cc->cls[(unsigned char)s[i]] & (CC_SPACE | CC_STOP | CC_KEYWORD)) == CC_SPACE) {
+        i++;
+    }
+    return i;
+}
+
+int syntaxFindAny(const char *s, int i, int len, const char *set, int n) {
+    // Index of the first of the n chars in set at or after s[i], or len
+#if defined(__AVX2__) || defined(__SSE2__)
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+        __m128i hit = _mm_setzero_si128();
+        for (int k = 0; k < n; k++) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[k])));
+        }
+        unsigned int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#endif
+    for (; i < len; i++) {
+        for (int k = 0; k < n; k++) {
+            if (s[i] == set[k]) {
+                return i;
+            }
+        }
+    }
+    return len;
+}
+
+int syntaxFindAnyBack(const char *s, int i, const char *set, int n) {
+    // Index of the last of the n chars in set before s[i], or -1
+#if defined(__AVX2__) || defined(__SSE2__)
+    while (i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i - 16]);
+        __m128i hit = _mm_setzero_si128();
+        for (int k = 0; k < n; k++) {
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[k])));
+        }
+        unsigned int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return i - 16 + 31 - __builtin_clz(mask);
+        }
+        i -= 16;
+    }
+#endif
+    while (--i >= 0) {
+        for (int k = 0; k < n; k++) {
+            if (s[i] == set[k]) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+int syntaxMatch(const char *s, int len, int i, const char *pat, int patlen) {
+    // Check if pat starts at s[i], without reading past s[len - 1]
+    return i + patlen <= len && !memcmp(&s[i], pat, patlen);
+}
+
+int syntaxScan(const struct editorSyntax *syn, const char *s, int len, int in_comment) {
+    // Return if a row starting with the given comment state ends
+    // inside a multi-line comment. This is the part of
+    // editorUpdateSyntax() that can change the state (comments and
+    // strings) without building hl, so it can run over raw chars of
+    // rows that are not on screen, or not even loaded. Only reads
+    // syn and s, so the highlight workers can call it.
+    if (syn == NULL) {
+        return 0;
+    }
+    char *scs = syn->singleline_comment_start;
+    char *mcs = syn->multiline_comment_start;
+    char *mce = syn->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    const struct charClasses *cc = syn->cclass;
+    char string_stops[2] = { '\\', 0 };
+
+    int in_string = 0;
+    int i = 0;
+    while (i < len) {
+        char c = s[i];
+
+        if (scs_len && !in_string && !in_comment && syntaxMatch(s, len, i, scs, scs_len)) {
+            return 0;
+        }
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                if (syntaxMatch(s, len, i, mce, mce_len)) {
+                    i += mce_len;
+                    in_comment = 0;
+                } else {
+                    i = syntaxFindAny(s, i + 1, len, mce, 1);
+                }
+                continue;
+            } else if (syntaxMatch(s, len, i, mcs, mcs_len)) {
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+        if (syn->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                if (c == '\\' && i + 1 < len) {
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) {
+                    in_string = 0;
+                    i++;
+                } else {
+                    string_stops[1] = in_string;
+                    i = syntaxFindAny(s, i + 1, len, string_stops, 2);
+                }
+                continue;
+            } else if (c == '"' || c == '\'') {
+                in_string = c;
+                i++;
+                continue;
+            }
+        }
+        // Nothing changes until the next char that may start a comment or string
+        i = syntaxFindAny(s, i + 1, len, cc->stops, cc->nstops);
+    }
+    return in_comment;
+}
+
+int editorSyntaxScan(const char *s, int len, int in_comment) {
+    return syntaxScan(E.syntax, s, len, in_comment);
+}
+
+int syntaxTransfer(const struct editorSyntax *syn, const char *text, size_t len) {
+    // Comment state transfer (see HL_TF_VALID) of the lines of text.
+    // Both start states are followed until they meet, after which
+    // they can't part again.
+    int s0 = 0, s1 = 1;
+    size_t off = 0, linelen;
+    while (off < len) {
+        const char *line = &text[off];
+        off += rowNextLine(line, len - off, &linelen);
+        if (s0 == s1) {
+            s0 = s1 = syntaxScan(syn, line, linelen, s0);
+        } else {
+            s0 = syntaxScan(syn, line, linelen, s0);
+            s1 = syntaxScan(syn, line, linelen, s1);
+        }
+    }
+    return HL_TF_VALID | s0 | s1 << 1;
+}
+
+unsigned int keywordHash(const char *s, int len, unsigned int seed) {
+    // FNV-1a, with the seed mixed in so the table can be made collision free
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+struct keywordTable *editorKeywordsCompile(char **keywords) {
+    // Build the hash table for a NULL-terminated keyword list. Keywords
+    // ending with '|' are secondary keywords. Seeds are tried until no
+    // two keywords share a slot, with the table growing if none works;
+    // if even that fails, lookups fall back to linear probing.
+    struct keywordTable *kt = calloc(1, sizeof(*kt));
+    if (kt == NULL) {
+        die("editorKeywordsCompile::calloc");
+    }
+    int n = 0;
+    while (keywords[n]) {
+        n++;
+    }
+    kt->minlen = INT_MAX;
+
+    unsigned int size = 8;
+    while (size < (unsigned int)n * 2) {
+        size <<= 1;
+    }
+
+    for (;;) {
+        free(kt->slots);
+        kt->slots = calloc(size, sizeof(struct keywordSlot));
+        if (kt->slots == NULL) {
+            die("editorKeywordsCompile::calloc");
+        }
+        kt->mask = size - 1;
+
+        int perfect = 0;
+        for (kt->seed = 0; kt->seed < 256 && !perfect; kt->seed++) {
+            memset(kt->slots, 0, size * sizeof(struct keywordSlot));
+            perfect = 1;
+            for (int j = 0; j < n && perfect; j++) {
+                int len = strlen(keywords[j]);
+                if (len > 0 && keywords[j][len - 1] == '|') {
+                    len--;
+                }
+                if (len == 0 || len > 255) {
+                    continue;
+                }
+                struct keywordSlot *slot = &kt->slots[keywordHash(keywords[j], len, kt->seed) & kt->mask];
+                if (slot->len == len && !memcmp(slot->word, keywords[j], len)) {
+                    continue; // Listed twice
+                }
+                perfect = slot->len == 0;
+                slot->word = keywords[j];
+                slot->len = len;
+            }
+        }
+        if (perfect) {
+            kt->seed--;
+            break;
+        }
+        if (size >= 4096) {
+            kt->seed = 0;
+            break;
+        }
+        size <<= 1;
+    }
+
+    // Fill in the table for good, probing in case no seed was perfect
+    memset(kt->slots, 0, (kt->mask + 1) * sizeof(struct keywordSlot));
+    for (int j = 0; j < n; j++) {
+        int len = strlen(keywords[j]);
+        int kw2 = len > 0 && keywords[j][len - 1] == '|';
+        if (kw2) {
+            len--;
+        }
+        if (len == 0 || len > 255) {
+            continue;
+        }
+        unsigned int h = keywordHash(keywords[j], len, kt->seed);
+        struct keywordSlot *slot = &kt->slots[h & kt->mask];
+        while (slot->len && !(slot->len == len && !memcmp(slot->word, keywords[j], len))) {
+            slot = &kt->slots[++h & kt->mask];
+        }
+        if (slot->len) {
+            continue;
+        }
+        slot->word = keywords[j];
+        slot->len = len;
+        slot->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+
+        kt->first[(unsigned char)keywords[j][0]] = 1;
+        if (len < kt->minlen) {
+            kt->minlen = len;
+        }
+        if (len > kt->maxlen) {
+            kt->maxlen = len;
+        }
+    }
+    return kt;
+}
+
+int editorKeywordMatch(const struct keywordTable *kt, const char *s, int len) {
+    // Return the highlight for the word s[0..len-1] if it is a keyword,
+    // HL_NORMAL otherwise.
+    if (len < kt->minlen || len > kt->maxlen) {
+        return HL_NORMAL;
+    }
+    unsigned int h = keywordHash(s, len, kt->seed);
+    const struct keywordSlot *slot = &kt->slots[h & kt->mask];
+    while (slot->len) {
+        if (slot->len == len && !memcmp(slot->word, s, len)) {
+            return slot->hl;
+        }
+        slot = &kt->slots[++h & kt->mask];
+    }
+    return HL_NORMAL;
+}
+
+int syntaxRunsPut(unsigned short *runs, int n, int color, int len) {
+    // Append len chars of one color to the n runs, growing the last
+    // run when it has the same color. Returns the new number of runs.
+    if (n > 0 && (runs[n - 1] & HL_RUN_COLOR) == color) {
+        int room = HL_RUN_MAX - (runs[n - 1] >> HL_RUN_BITS);
+        int k = len < room ? len : room;
+        runs[n - 1] += k << HL_RUN_BITS;
+        len -= k;
+    }
+    while (len > 0) {
+        int k = len < HL_RUN_MAX ? len : HL_RUN_MAX;
+        runs[n++] = k << HL_RUN_BITS | color;
+        len -= k;
+    }
+    return n;
+}
+
+int syntaxRunSeek(const unsigned short *runs, int n, int k, int *pos, int at) {
+    // Starting from run k, which begins at char *pos, find the run
+    // holding char at and set *pos to where it begins. Returns n if at
+    // is past the last run.
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Eight lengths of at most HL_RUN_MAX fit in a 16 bit lane, so
+    // 64 runs are added up with a single horizontal sum
+    const __m128i ones = _mm_set1_epi16(1);
+    while (n - k >= 64) {
+        __m128i sum = _mm_setzero_si128();
+        for (int j = 0; j < 64; j += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)&runs[k + j]);
+            sum = _mm_add_epi16(sum, _mm_srli_epi16(v, HL_RUN_BITS));
+        }
+        sum = _mm_madd_epi16(sum, ones);
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+        int len = _mm_cvtsi128_si32(sum);
+        if (*pos + len > at) {
+            break;
+        }
+        *pos += len;
+        k += 64;
+    }
+#endif
+    while (k < n && *pos + (runs[k] >> HL_RUN_BITS) <= at) {
+        *pos += runs[k++] >> HL_RUN_BITS;
+    }
+    return k;
+}
+
+void editorRowSetHl(erow *row, int from, int to, const unsigned char *hl, int n) {
+    // Replace the colors of chars from..to-1 with the n colors of hl,
+    // or with n HL_NORMAL if hl is NULL. Only the runs holding from
+    // and to are split or merged, the others are moved as they are.
+    struct rowView *v = editorRowView(row);
+    int pos = 0;
+    int a = syntaxRunSeek(v->hl, v->hlruns, 0, &pos, from);
+    // Take the run before along, so the new colors can join it
+    if (a > 0 && pos == from) {
+        pos -= v->hl[--a] >> HL_RUN_BITS;
+    }
+    int bpos = pos;
+    int b = syntaxRunSeek(v->hl, v->hlruns, a, &bpos, to);
+
+    // Runs a..b, the ends of the first and last cut to from and to,
+    // are replaced with the runs built here
+    int need = n + n / HL_RUN_MAX + 3;
+    if (need > E.hl_runbufcap) {
+        E.hl_runbufcap = need * 2;
+        E.hl_runbuf = realloc(E.hl_runbuf, E.hl_runbufcap * sizeof(unsigned short));
+        if (E.hl_runbuf == NULL) {
+            die("editorRowSetHl::realloc");
+        }
+    }
+    unsigned short *runs = E.hl_runbuf;
+    int m = 0;
+    if (from > pos) {
+        m = syntaxRunsPut(runs, m, v->hl[a] & HL_RUN_COLOR, from - pos);
+    }
+    if (hl == NULL) {
+        m = syntaxRunsPut(runs, m, HL_NORMAL, n);
+    } else {
+        for (int j = 0; j < n; ) {
+            int k = j + 1;
+            while (k < n && hl[k] == hl[j]) {
+                k++;
+            }
+            m = syntaxRunsPut(runs, m, hl[j], k - j);
+            j = k;
+        }
+    }
+    int end = b;
+    if (b < v->hlruns) {
+        m = syntaxRunsPut(runs, m, v->hl[b] & HL_RUN_COLOR,
+                          bpos + (v->hl[b] >> HL_RUN_BITS) - to);
+        end = b + 1;
+    }
+
+    int nruns = v->hlruns - (end - a) + m;
+    int size = nruns * sizeof(unsigned short);
+    if (size > v->hlcap) {
+        int hlcap = slabRound(size > v->hlcap * 2 ? size : v->hlcap * 2);
+        v->hl = slabRealloc(v->hl, v->hlcap, hlcap);
+        v->hlcap = hlcap;
+    }
+    if (v->hl) {
+        memmove(&v->hl[a + m], &v->hl[end], (v->hlruns - end) * sizeof(unsigned short));
+        memcpy(&v->hl[a], runs, m * sizeof(unsigned short));
+    }
+    v->hlruns = nruns;
+}
+
+void editorUpdateSyntax(erow *row, int in_comment, int from, int to) {
+    // Find the colors of a row starting with the given comment state.
+    // Only the colors of chars[from..to-1] need to be found again,
+    // pass 0 and size for the whole row. A tab gets the color the
+    // spaces it's drawn with would get.
+    struct rowView *v = editorRowView(row);
+    if (v->hl == NULL) {
+        from = 0;
+        to = row->size;
+    }
+    if (from == 0 && to == row->size) {
+        v->hlruns = 0;
+    }
+
+    // No highlighting required
+    if (E.syntax == NULL) {
+        editorRowSetHl(row, from, to, NULL, to - from);
+        return;
+    }
+
+    // The new colors are found one byte per char in hl_buf, then
+    // packed into runs. The old colors are read from the runs.
+    if (E.hl_buf == NULL || row->size > E.hl_bufcap) {
+        // Made even for an empty row, so hl is never NULL below
+        E.hl_bufcap = row->size ? row->size * 2 : 64;
+        free(E.hl_buf);
+        E.hl_buf = malloc(E.hl_bufcap);
+        if (E.hl_buf == NULL) {
+            die("editorUpdateSyntax::malloc");
+        }
+    }
+    unsigned char *hl = E.hl_buf;
+
+    const struct keywordTable *kt = E.syntax->kwtable;
+    const struct charClasses *cc = E.syntax->cclass;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    // Start right after the last plain separator far enough before the
+    // stale colors that they can't have changed it (by looking ahead
+    // for a comment start or a keyword): the state there is known,
+    // nothing is open and prev_sep is set.
+    int look = scs_len > mcs_len ? scs_len : mcs_len;
+    if (look < mce_len) {
+        look = mce_len;
+    }
+    if (kt && look < kt->maxlen + 1) {
+        look = kt->maxlen + 1;
+    }
+    int i = from - look > 0 ? from - look : 0;
+    int pos = 0;
+    int run = syntaxRunSeek(v->hl, v->hlruns, 0, &pos, i);
+    while (i > 0) {
+        if (i - 1 < pos) {
+            pos -= v->hl[--run] >> HL_RUN_BITS;
+        }
+        if ((v->hl[run] & HL_RUN_COLOR) != HL_NORMAL) {
+            // No plain separator in this run
+            i = pos;
+        } else if (cc->cls[(unsigned char)row->chars[i - 1]] & CC_SEPARATOR) {
+            break;
+        } else {
+            i--;
+        }
+    }
+    if (i > 0) {
+        in_comment = 0;
+    } else {
+        i = 0;
+    }
+    memset(&hl[i], HL_NORMAL, to - i);
+    int first = i;
+    int end = row->size;
+
+    while (i < row->size) {
+        char c = row->chars[i];
+        unsigned char prev_hl = (i > first) ? hl[i - 1] : HL_NORMAL;
+
+        // Check if it's a single line comment
+        if (scs_len && !in_string && !in_comment) {
+            if (i + scs_len <= row->size && !memcmp(&row->chars[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, row->size - i);
+                break;
+            }
+        }
+
+        // Check if it's a multi-line comment
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                hl[i] = HL_MLCOMMENT;
+                if(i + mce_len <= row->size && !memcmp(&row->chars[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    int end = syntaxFindAny(row->chars, i + 1, row->size, mce, 1);
+                    memset(&hl[i], HL_MLCOMMENT, end - i);
+                    i = end;
+                    continue;
+                }
+            } else if (i + mcs_len <= row->size && !memcmp(&row->chars[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < row->size) {
+                    hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == in_string) {
+                    in_string = 0;
+                }
+                i++;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+        // Check if numbers should be highlighted for current filetype
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if(((cc->cls[(unsigned char)c] & CC_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        // Keywords are whole words: find where the word starting
+        // here ends, giving up as soon as it is longer than any keyword
+        if (prev_sep && kt && (cc->cls[(unsigned char)c] & CC_KEYWORD)) {
+            int klen = 1;
+            while (i + klen < row->size && klen <= kt->maxlen &&
+                !(cc->cls[(unsigned char)row->chars[i + klen]] & CC_SEPARATOR)) {
+                klen++;
+            }
+            int kw = editorKeywordMatch(kt, &row->chars[i], klen);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        // Plain text: skip the rest of the word, or of the whitespace
+        int start = i++;
+        if (cc->cls[(unsigned char)c] & CC_SEPARATOR) {
+            // Past the stale colors, a plain separator that was plain
+            // before too leaves both scans in the same state: the rest
+            // of the old colors are still right.
+            if (start >= to && !in_comment) {
+                run = syntaxRunSeek(v->hl, v->hlruns, run, &pos, start);
+                if ((v->hl[run] & HL_RUN_COLOR) == HL_NORMAL) {
+                    end = start;
+                    break;
+                }
+            }
+            prev_sep = 1;
+            if (cc->cls[(unsigned char)c] & CC_SPACE) {
+                i = syntaxSkipSpace(cc, row->chars, i, row->size);
+            }
+        } else {
+            prev_sep = 0;
+            i = syntaxSkipWord(cc, row->chars, i, row->size);
+        }
+        if (i > to) {
+            memset(&hl[start], HL_NORMAL, i - start);
+        }
+    }
+
+    if (end == row->size) {
+        row->hl_open_comment = in_comment;
+    }
+    editorRowSetHl(row, first, end, &hl[first], end - first);
+}
+
+void editorSyntaxAddRange(int from, int to) {
+    // Add rows from..to-1 to the highlighter worklist, keeping it
+    // sorted and merging ranges that touch. When the list is full
+    // the new range is folded into the last one starting before it.
+    // Rows changed, so the highlight jobs in flight are stale.
+    E.hl_gen++;
+    E.hl_waiting = 0;
+
+    int i = E.hl_ndirty;
+    if (i == HL_DIRTY_MAX) {
+        i--;
+        while (i > 0 && E.hl_dirty[i].from > from) {
+            i--;
+        }
+        if (E.hl_dirty[i].from > from) {
+            E.hl_dirty[i].from = from;
+        }
+        if (E.hl_dirty[i].to < to) {
+            E.hl_dirty[i].to = to;
+        }
+    } else {
+        while (i > 0 && E.hl_dirty[i - 1].from > from) {
+            E.hl_dirty[i] = E.hl_dirty[i - 1];
+            i--;
+        }
+        E.hl_dirty[i].from = from;
+        E.hl_dirty[i].to = to;
+        E.hl_ndirty++;
+    }
+
+    int n = 0;
+    for (i = 1; i < E.hl_ndirty; i++) {
+        if (E.hl_dirty[i].from <= E.hl_dirty[n].to) {
+            if (E.hl_dirty[i].to > E.hl_dirty[n].to) {
+                E.hl_dirty[n].to = E.hl_dirty[i].to;
+            }
+        } else {
+            E.hl_dirty[++n] = E.hl_dirty[i];
+        }
+    }
+    E.hl_ndirty = n + 1;
+}
+
+void editorSyntaxInvalidate(int at) {
+    // Row `at` changed: its comment state has to be checked again,
+    // and so has the state of the rows after it, up to the first
+    // one that doesn't change.
+    if (at < 0) {
+        at = 0;
+    }
+    editorSyntaxAddRange(at, at + 1);
+}
+
+void editorSyntaxRowsInserted(int at, int n) {
+    // Row numbers in the worklist past `at` move down by n, and the n
+    // new rows join it
+    for (int i = 0; i < E.hl_ndirty; i++) {
+        if (E.hl_dirty[i].from > at) {
+            E.hl_dirty[i].from += n;
+        }
+        if (E.hl_dirty[i].to > at) {
+            E.hl_dirty[i].to += n;
+        }
+    }
+    editorSyntaxAddRange(at, at + n);
+}
+
+void editorSyntaxRowsDeleted(int at, int n) {
+    // Row numbers in the worklist past the n rows deleted at `at` move
+    // up by n, those among them end up at `at`, and the row taking the
+    // place of the deleted ones may start differently
+    for (int i = 0; i < E.hl_ndirty; i++) {
+        if (E.hl_dirty[i].from > at) {
+            E.hl_dirty[i].from = E.hl_dirty[i].from > at + n ? E.hl_dirty[i].from - n : at;
+        }
+        if (E.hl_dirty[i].to > at) {
+            E.hl_dirty[i].to = E.hl_dirty[i].to > at + n ? E.hl_dirty[i].to - n : at;
+        }
+    }
+    editorSyntaxInvalidate(at);
+}
+
+int editorSyntaxFrontier() {
+    // First row whose comment state may be out of date
+    if (E.hl_ndirty > 0 && E.hl_dirty[0].from < E.numrows) {
+        return E.hl_dirty[0].from;
+    }
+    return E.numrows;
+}
+
+int editorSyntaxStateAfter(int at) {
+    // Comment state at the end of row `at`, which must be
+    // before the highlight frontier.
+    int slot;
+    rowNode *leaf = rowTreeLocate(at, &slot);
+    if (leaf == NULL || E.syntax == NULL) {
+        return 0;
+    }
+    if (leaf->rows) {
+        return leaf->rows[slot].hl_open_comment;
+    }
+    if (slot == leaf->n - 1) {
+        return leaf->hl_out;
+    }
+
+    int state = leaf->hl_in;
+    size_t off = 0, linelen;
+    for (int j = 0; j <= slot; j++) {
+        const char *line = &leaf->text[off];
+        off += rowNextLine(line, leaf->textlen - off, &linelen);
+        state = editorSyntaxScan(line, linelen, state);
+    }
+    return state;
+}
+
+int editorSyntaxPending() {
+    return E.syntax && editorSyntaxFrontier() < E.numrows;
+}
+
+void editorSyntaxWorker(void *arg) {
+    // Pool job: find the comment state transfers of the snapshot in
+    // job, then hand it back to the main thread through hl_done.
+    struct hlJob *job = arg;
+    for (int k = 0; k < job->nleaves; k++) {
+        if (job->text[k]) {
+            job->out[k] = syntaxTransfer(job->syntax, job->text[k], job->textlen[k]);
+            continue;
+        }
+        for (int j = job->first[k]; j < job->first[k + 1]; j++) {
+            int s0 = syntaxScan(job->syntax, job->line[j], job->linelen[j], 0);
+            int s1 = syntaxScan(job->syntax, job->line[j], job->linelen[j], 1);
+            job->tf[j] = HL_TF_VALID | s0 | s1 << 1;
+        }
+    }
+
+    pthread_mutex_lock(&E.hl_lock);
+    job->next = E.hl_done;
+    E.hl_done = job;
+    if (job->next == NULL) {
+        write(E.workpipe[1], "h", 1);
+    }
+    pthread_mutex_unlock(&E.hl_lock);
+}
+
+void editorSyntaxJobFree(struct hlJob *job) {
+    free(job->line);
+    free(job->linelen);
+    free(job->tf);
+    free(job->copy);
+    free(job);
+}
+
+void editorSyntaxSubmit(struct hlJob *job) {
+    // Take the snapshot of the leaves of job and queue it. The text of
+    // leaves not loaded, and of rows never edited, is in the file
+    // mapping, which doesn't change: only edited rows are copied.
+    int nlines = 0;
+    size_t ncopy = 0;
+    for (int k = 0; k < job->nleaves; k++) {
+        rowNode *leaf = job->leaf[k];
+        job->first[k] = nlines;
+        if (leaf->rows == NULL) {
+            job->text[k] = leaf->text;
+            job->textlen[k] = leaf->textlen;
+            continue;
+        }
+        nlines += leaf->n;
+        for (int j = 0; j < leaf->n; j++) {
+            if (!leaf->rows[j].mapped) {
+                ncopy += leaf->rows[j].size;
+            }
+        }
+    }
+    job->first[job->nleaves] = nlines;
+
+    job->line = malloc(sizeof(char *) * (nlines + 1));
+    job->linelen = malloc(sizeof(int) * (nlines + 1));
+    job->tf = malloc(nlines + 1);
+    job->copy = malloc(ncopy + 1);
+    if (job->line == NULL || job->linelen == NULL || job->tf == NULL || job->copy == NULL) {
+        die("editorSyntaxSubmit::malloc");
+    }
+    char *p = job->copy;
+    int r = 0;
+    for (int k = 0; k < job->nleaves; k++) {
+        rowNode *leaf = job->leaf[k];
+        for (int j = 0; leaf->rows && j < leaf->n; j++, r++) {
+            erow *row = &leaf->rows[j];
+            job->line[r] = row->chars;
+            job->linelen[r] = row->size;
+            if (!row->mapped) {
+                memcpy(p, row->chars, row->size);
+                job->line[r] = p;
+                p += row->size;
+            }
+        }
+        leaf->hl_job = E.hl_gen;
+    }
+
+    job->gen = E.hl_gen;
+    job->syntax = E.syntax;
+    E.hl_jobs++;
+    poolSubmit(editorSyntaxWorker, job, &E.hl_running);
+}
+
+int editorSyntaxLeafWanted(rowNode *leaf) {
+    // Is it worth handing the leaf to a worker: it isn't already, and
+    // the frontier would otherwise have to scan a good part of it
+    if (leaf->hl_job == E.hl_gen) {
+        return 0;
+    }
+    if (leaf->rows == NULL) {
+        return !(leaf->hl_tf & HL_TF_VALID);
+    }
+    int missing = 0;
+    for (int j = 0; j < leaf->n; j++) {
+        if (!(leaf->rows[j].hl_tf & HL_TF_VALID)) {
+            missing++;
+        }
+    }
+    return missing >= HL_JOB_MIN_ROWS;
+}
+
+void editorSyntaxDispatch() {
+    // Queue jobs for the leaves right past the frontier, keeping
+    // about two jobs per worker in flight so that none of them idles
+    // while the main thread installs results.
+    if (pool.nthreads == 0 || !editorSyntaxPending()) {
+        return;
+    }
+    int slot;
+    rowNode *leaf = rowTreeLocate(editorSyntaxFrontier(), &slot);
+    int room = pool.nthreads * 2 - E.hl_jobs;
+    int lookahead = pool.nthreads * 2 * HL_JOB_LEAVES;
+    struct hlJob *job = NULL;
+
+    for (; leaf && room > 0 && lookahead > 0; leaf = leaf->next, lookahead--) {
+        if (!editorSyntaxLeafWanted(leaf)) {
+            continue;
+        }
+        if (job == NULL) {
+            job = calloc(1, sizeof(struct hlJob));
+            if (job == NULL) {
+                die("editorSyntaxDispatch::calloc");
+            }
+        }
+        job->leaf[job->nleaves++] = leaf;
+        if (job->nleaves == HL_JOB_LEAVES) {
+            editorSyntaxSubmit(job);
+            job = NULL;
+            room--;
+        }
+    }
+    if (job) {
+        editorSyntaxSubmit(job);
+    }
+}
+
+void editorSyntaxCollect() {
+    // Install what the workers found. Results of a job taken before
+    // the last edit are dropped; for the others nothing changed since
+    // the snapshot, so its leaves are all still there, as they were.
+    pthread_mutex_lock(&E.hl_lock);
+    struct hlJob *job = E.hl_done;
+    E.hl_done = NULL;
+    pthread_mutex_unlock(&E.hl_lock);
+
+    while (job) {
+        struct hlJob *next = job->next;
+        for (int k = 0; job->gen == E.hl_gen && k < job->nleaves; k++) {
+            rowNode *leaf = job->leaf[k];
+            leaf->hl_job = 0;
+            if (job->text[k]) {
+                leaf->hl_tf = job->out[k];
+                continue;
+            }
+            for (int j = 0; j < leaf->n; j++) {
+                leaf->rows[j].hl_tf = job->tf[job->first[k] + j];
+            }
+        }
+        E.hl_jobs--;
+        editorSyntaxJobFree(job);
+        job = next;
+    }
+    E.hl_waiting = 0;
+}
+
+void editorSyntaxMergePassed() {
+    // The first range was walked up to where it stopped, possibly
+    // into the ranges after it: carry on with all of those at once,
+    // keeping the list sorted
+    struct hlRange *d = &E.hl_dirty[0];
+    int k = 1;
+    while (k < E.hl_ndirty && d->from >= E.hl_dirty[k].from) {
+        if (d->to < E.hl_dirty[k].to) {
+            d->to = E.hl_dirty[k].to;
+        }
+        k++;
+    }
+    memmove(&E.hl_dirty[1], &E.hl_dirty[k], sizeof(struct hlRange) * (E.hl_ndirty - k));
+    E.hl_ndirty -= k - 1;
+}
+
+void editorSyntaxAdvance(int until, int budget, int wait) {
+    // Work through the highlighter worklist, going no further than
+    // row `until` and stopping once about `budget` rows have been
+    // looked at. Propagation stops at the first row (past the changed
+    // ones) that was already checked and starts with the state it had:
+    // the rows after it can't change. Leaves never loaded are scanned
+    // straight from the file mapping. Rows and leaves whose transfer
+    // a worker found aren't scanned at all. With `wait`, stop at a
+    // leaf a worker is still busy with rather than scanning it too.
+    if (E.syntax == NULL) {
+        E.hl_ndirty = 0;
+        return;
+    }
+    if (until > E.numrows) {
+        until = E.numrows;
+    }
+
+    while (E.hl_ndirty > 0 && budget > 0) {
+        struct hlRange *d = &E.hl_dirty[0];
+        if (d->from >= E.numrows) {
+            E.hl_ndirty = 0; // The list is sorted, all ranges are past the end
+            break;
+        }
+        if (d->from >= until) {
+            break;
+        }
+
+        int state = editorSyntaxStateAfter(d->from - 1);
+        int converged = 0;
+        while (!converged && d->from < until && budget > 0) {
+            int slot;
+            rowNode *leaf = rowTreeLocate(d->from, &slot);
+            if (wait && leaf->hl_job == E.hl_gen) {
+                E.hl_waiting = 1;
+                editorSyntaxMergePassed();
+                return;
+            }
+
+            if (leaf->rows == NULL && slot == 0) {
+                if (leaf->hl_cached && leaf->hl_in == state && d->from >= d->to) {
+                    converged = 1;
+                    break;
+                }
+                int cost = 1;
+                if (!leaf->hl_cached || leaf->hl_in != state) {
+                    leaf->hl_in = state;
+                    if (leaf->hl_tf & HL_TF_VALID) {
+                        state = (leaf->hl_tf >> state) & 1;
+                    } else {
+                        size_t off = 0, linelen;
+                        for (int j = 0; j < leaf->n; j++) {
+                            const char *line = &leaf->text[off];
+                            off += rowNextLine(line, leaf->textlen - off, &linelen);
+                            state = editorSyntaxScan(line, linelen, state);
+                        }
+                        cost = leaf->n;
+                    }
+                    leaf->hl_out = state;
+                    leaf->hl_cached = 1;
+                }
+                state = leaf->hl_out;
+                d->from += leaf->n;
+                budget -= cost;
+                continue;
+            }
+            if (leaf->rows == NULL) {
+                leaf = rowTreeFind(d->from, &slot);
+            }
+
+            for (; slot < leaf->n && d->from < until && budget > 0; slot++, budget--) {
+                erow *row = &leaf->rows[slot];
+                int cached = (row->hl_cached & (HL_CACHE_STATE | HL_CACHE_EXACT)) ==
+                    (HL_CACHE_STATE | HL_CACHE_EXACT) && row->hl_start == state;
+                if (cached && d->from >= d->to) {
+                    converged = 1;
+                    break;
+                }
+                if (!cached) {
+                    // If the row is on screen, it was drawn with the wrong colors
+                    if ((row->hl_cached & HL_CACHE_HL) && row->hl_start != state &&
+                        d->from >= E.rowoff && d->from < E.rowoff + E.screenrows) {
+                        E.hl_redraw = 1;
+                    }
+                    if ((row->hl_cached & (HL_CACHE_STATE | HL_CACHE_HL)) == HL_CACHE_HL &&
+                        row->hl_start == state && row->view->hl_from >= 0) {
+                        // Edited since it was highlighted: highlighting
+                        // the edits again also finds the end state
+                        editorUpdateSyntax(row, state, row->view->hl_from, row->view->hl_to);
+                        row->view->hl_from = -1;
+                        row->hl_cached = HL_CACHE_STATE | HL_CACHE_HL;
+                    } else if (!(row->hl_cached & HL_CACHE_STATE) || row->hl_start != state) {
+                        row->hl_start = state;
+                        if (row->hl_tf & HL_TF_VALID) {
+                            row->hl_open_comment = (row->hl_tf >> state) & 1;
+                        } else {
+                            row->hl_open_comment = editorSyntaxScan(row->chars, row->size, state);
+                        }
+                        row->hl_cached = HL_CACHE_STATE;
+                    }
+                    row->hl_cached |= HL_CACHE_EXACT;
+                }
+                state = row->hl_open_comment;
+                d->from++;
+            }
+        }
+
+        if (converged || d->from >= E.numrows) {
+            memmove(&E.hl_dirty[0], &E.hl_dirty[1], sizeof(struct hlRange) * (E.hl_ndirty - 1));
+            E.hl_ndirty--;
+        } else {
+            editorSyntaxMergePassed();
+        }
+    }
+}
+
+int editorSyntaxIdlePending() {
+    return editorSyntaxPending() && !E.hl_waiting;
+}
+
+void editorSyntaxIdle() {
+    // Background task: keep the workers busy with the rows ahead and
+    // move the highlight frontier a slice further with what they
+    // found. If rows on screen turn out to be wrong, the event loop
+    // redraws.
+    editorSyntaxDispatch();
+    editorSyntaxAdvance(E.numrows, HL_SLICE_ROWS, 1);
+}
+
+void editorRowHighlight(int at) {
+    // Make sure row `at` has an up to date hl. Rows up to the
+    // frontier know their starting state, and rows past it are drawn
+    // with the state they had last time they were checked. Rows never
+    // checked are plain text until the frontier gets to them.
+    erow *row = editorRowAt(at);
+    struct rowView *v = editorRowView(row);
+    int exact = at <= editorSyntaxFrontier();
+    int start = 0;
+    if (exact) {
+        start = editorSyntaxStateAfter(at - 1);
+    } else if (row->hl_cached & HL_CACHE_EXACT) {
+        start = row->hl_start;
+    } else {
+        if (!(row->hl_cached & HL_CACHE_HL) || row->hl_start != HL_START_PLAIN ||
+            v->hl == NULL) {
+            row->hl_start = HL_START_PLAIN;
+            row->hl_cached = HL_CACHE_HL;
+            v->hlruns = 0;
+            v->hl_from = 0;
+            v->hl_to = row->size;
+        }
+        if (v->hl_from >= 0) {
+            editorRowSetHl(row, v->hl_from, v->hl_to, NULL, v->hl_to - v->hl_from);
+            v->hl_from = -1;
+        }
+        return;
+    }
+
+    int same = (row->hl_cached & HL_CACHE_HL) && row->hl_start == start;
+    if (same && v->hl_from < 0) {
+        return;
+    }
+    int keep = row->hl_start == start ? (row->hl_cached & HL_CACHE_EXACT) : 0;
+    // Edits since the row was highlighted only need their part of
+    // the row highlighted again
+    if (same) {
+        editorUpdateSyntax(row, start, v->hl_from, v->hl_to);
+    } else {
+        editorUpdateSyntax(row, start, 0, row->size);
+    }
+    v->hl_from = -1;
+    row->hl_start = start;
+    row->hl_cached = HL_CACHE_STATE | HL_CACHE_HL | (exact ? HL_CACHE_EXACT : keep);
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT:
+            return 36;
+        case HL_KEYWORD1:
+            return 33;
+        case HL_KEYWORD2:
+            return 32;
+        case HL_STRING:
+            return 35;
+        case HL_NUMBER:
+            return 31;
+        case HL_MATCH:
+            return 34;
+        default:
+            return 37;
+    }
+}
+
+void editorSyntaxReset() {
+    // Nothing gets highlighted here: cached results are dropped and
+    // rows are highlighted again as they are drawn, or between
+    // keystrokes for the rest of the file.
+    for (rowNode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        leaf->hl_cached = 0;
+        leaf->hl_tf = 0;
+        if (leaf->rows) {
+            for (int j = 0; j < leaf->n; j++) {
+                leaf->rows[j].hl_cached = 0;
+                leaf->rows[j].hl_tf = 0;
+            }
+        }
+    }
+    E.hl_ndirty = 0;
+    editorSyntaxAddRange(0, E.numrows);
+}
+
+void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
     // New file
     if (E.filename == NULL) {
         return;
     }
 
-    char *ext = strrchr(E.filename, '.');
+    char *ext = strrchr(E.filename, '.');
+
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            // strrchr() returns a pointer to the last occurence of the . in the filename
+            // strcmp() returns 0 if two strings are equal
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->kwtable == NULL && s->keywords) {
+                    s->kwtable = editorKeywordsCompile(s->keywords);
+                }
+                if (s->cclass == NULL) {
+                    s->cclass = malloc(sizeof(struct charClasses));
+                    if (s->cclass == NULL) {
+                        die("editorSelectSyntaxHighlight::malloc");
+                    }
+                    editorCharClassInit(s->cclass, s);
+                }
+                editorSyntaxReset();
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+int editorRowRxAt(erow *row, int k) {
+    // rx of char k * RX_CHECKPOINT. Checkpoints are filled in as they
+    // are needed, from the last one still good: an edit only drops
+    // the ones after the edited char.
+    struct rowView *v = editorRowView(row);
+    if (k >= v->rxvalid) {
+        if (k >= v->rxcap) {
+            v->rxcap = row->size / RX_CHECKPOINT + 1;
+            v->rxmap = realloc(v->rxmap, sizeof(int) * v->rxcap);
+            if (v->rxmap == NULL) {
+                die("editorRowRxAt::realloc");
+            }
+        }
+        if (v->rxvalid == 0) {
+            v->rxmap[0] = 0;
+            v->rxvalid = 1;
+        }
+        int j = (v->rxvalid - 1) * RX_CHECKPOINT;
+        int rx = v->rxmap[v->rxvalid - 1];
+        while (v->rxvalid <= k) {
+            for (int end = j + RX_CHECKPOINT; j < end; j++) {
+                if (row->chars[j] == '\t') {
+                    rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+                }
+                rx++;
+            }
+            v->rxmap[v->rxvalid++] = rx;
+        }
+    }
+    return v->rxmap[k];
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    struct rowView *v = editorRowView(row);
+    // When the row is as wide as its text every tab is one
+    // column wide, so columns map one to one
+    if (v->rsize == row->size) {
+        return cx;
+    }
+    int rx = 0;
+    int j = 0;
+
+    // Start from the last checkpoint before cx
+    if (row->size >= RX_CHECKPOINT) {
+        int k = (cx < row->size ? cx : row->size) / RX_CHECKPOINT;
+        j = k * RX_CHECKPOINT;
+        rx = editorRowRxAt(row, k);
+    }
+    for (; j < cx; j++) {
+        if (row->chars[j] == '\t') {
+            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+        }
+        rx++;
+    }
+
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    struct rowView *v = editorRowView(row);
+    if (v->rsize == row->size) {
+        return rx < row->size ? rx : row->size;
+    }
+    int cur_rx = 0;
+    int cx = 0;
+
+    // Find the last checkpoint at or before rx: binary search the
+    // ones known, or fill in more if they all are before rx
+    if (row->size >= RX_CHECKPOINT) {
+        int last = row->size / RX_CHECKPOINT;
+        int k = 0;
+        editorRowRxAt(row, 0);
+        if (v->rxmap[v->rxvalid - 1] <= rx) {
+            k = v->rxvalid - 1;
+            while (k < last && editorRowRxAt(row, k + 1) <= rx) {
+                k++;
+            }
+        } else {
+            int hi = v->rxvalid - 1;
+            while (k + 1 < hi) {
+                int mid = (k + hi) / 2;
+                if (v->rxmap[mid] <= rx) {
+                    k = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+        }
+        cx = k * RX_CHECKPOINT;
+        cur_rx = v->rxmap[k];
+    }
+    for (; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t') {
+            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+        }
+        cur_rx++;
+        if (cur_rx > rx) {
+            return cx;
+        }
+    }
+
+    return cx;
+}
+
+struct rowView *editorRowView(erow *row) {
+    // The view of the row, made on first use. It starts with the
+    // width of the row, found expanding tabs: the expanded text isn't
+    // kept, rows are highlighted and drawn from chars with the tabs
+    // expanded on the fly.
+    if (row->view) {
+        return row->view;
+    }
+    struct rowView *v = slabAlloc(slabRound(sizeof(struct rowView)));
+    v->rxmap = NULL;
+    v->rxvalid = 0;
+    v->rxcap = 0;
+    v->hl = NULL;
+    v->hlruns = 0;
+    v->hlcap = 0;
+    v->hl_from = -1;
+    v->hl_to = 0;
+
+    const char *tab = memchr(row->chars, '\t', row->size);
+    int rx = tab ? tab - row->chars : row->size;
+    for (int j = rx; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+        }
+        rx++;
+    }
+    v->rsize = rx;
+    row->view = v;
+    return v;
+}
+
+void editorRowFreeView(erow *row) {
+    struct rowView *v = row->view;
+    if (v == NULL) {
+        return;
+    }
+    free(v->rxmap);
+    slabFree(v->hl, v->hlcap);
+    slabFree(v, slabRound(sizeof(struct rowView)));
+    row->view = NULL;
+}
+
+void editorUpdateRow(int at) {
+    // The text of row `at` changed: drop its view, with the highlight
+    // cache. It's measured and highlighted again when it's drawn next.
+    erow *row = editorRowAt(at);
+    editorRowFreeView(row);
+    row->hl_cached = 0;
+    row->hl_tf = 0;
+    editorSyntaxInvalidate(at);
+    editorFindRowChanged(at);
+}
+
+void editorUndoTrim() {
+    // Keep the log under UNDO_MAX_BYTES by forgetting the oldest
+    // groups. Down to 3/4 of the cap, so that moving what is left
+    // down happens once in a while.
+    struct undoLog *u = &E.undo;
+    size_t opsize = sizeof(struct undoOp);
+    if ((size_t)u->text.len + u->nops * opsize <= UNDO_MAX_BYTES) {
+        return;
+    }
+    int k = 0;
+    while (k < u->nops && (size_t)(u->text.len - u->ops[k].off) + (u->nops - k) * opsize > UNDO_MAX_BYTES / 4 * 3) {
+        unsigned int g = u->ops[k].group;
+        while (k < u->nops && u->ops[k].group == g) {
+            k++;
+        }
+    }
+    if (k == u->nops && u->nops > 0 && u->ops[k - 1].group == u->group) {
+        // The group being recorded doesn't fit: record none of it,
+        // it couldn't be undone as a whole anyway
+        u->dropped = u->group;
+    }
+
+    int base = k < u->nops ? u->ops[k].off : u->text.len;
+    memmove(u->text.b, &u->text.b[base], u->text.len - base);
+    u->text.len -= base;
+    memmove(u->ops, &u->ops[k], opsize * (u->nops - k));
+    u->nops -= k;
+    u->applied -= k;
+    if (u->applied < 0) {
+        u->applied = 0;
+    }
+    for (int i = 0; i < u->nops; i++) {
+        u->ops[i].off -= base;
+    }
+}
+
+void editorUndoRecord(int type, int row, int col, const char *s, int len) {
+    // Log an edit made by one of the row operations. For row edits s
+    // is the row text, stored followed by a newline. An op continuing
+    // the previous one of the group (typing, backspacing, the rows of
+    // a paste) is merged into it, so that a run takes one op.
+    struct undoLog *u = &E.undo;
+    if (u->replay || u->group == u->dropped || (len == 0 && type != UNDO_INSERT_ROWS && type != UNDO_DELETE_ROWS)) {
+        return;
+    }
+    int rows = type == UNDO_INSERT_ROWS || type == UNDO_DELETE_ROWS;
+    int total = len + rows;
+    if (abReserve(&u->text, total) == -1) {
+        u->nops = u->applied = 0;
+        u->text.len = 0;
+        u->dropped = u->group;
+        return;
+    }
+    // A new edit drops what could be redone
+    if (u->applied < u->nops) {
+        u->text.len = u->ops[u->applied].off;
+        u->nops = u->applied;
+    }
+
+    struct undoOp *last = u->nops > 0 ? &u->ops[u->nops - 1] : NULL;
+    int append = 0, prepend = 0;
+    if (last && last->group == u->group && last->type == type) {
+        switch (type) {
+            case UNDO_INSERT:
+                append = row == last->row && col == last->col + last->len;
+                break;
+            case UNDO_DELETE:
+                append = row == last->row && col == last->col; // Delete key
+                prepend = row == last->row && col + len == last->col; // Backspace
+                break;
+            case UNDO_INSERT_ROWS:
+                append = row == last->row + last->n;
+                break;
+            case UNDO_DELETE_ROWS:
+                append = row == last->row;
+                prepend = row + 1 == last->row;
+                break;
+        }
+    }
+
+    if (append || prepend) {
+        char *at = &u->text.b[append ? u->text.len : last->off];
+        if (prepend) {
+            memmove(at + total, at, last->len);
+            last->row = row;
+            last->col = col;
+        }
+        memcpy(at, s, len);
+        if (rows) {
+            at[len] = '\n';
+        }
+        last->len += total;
+        last->n += rows;
+        u->text.len += total;
+    } else {
+        if (u->nops == u->cap) {
+            u->cap = u->cap ? u->cap * 2 : 64;
+            u->ops = realloc(u->ops, sizeof(struct undoOp) * u->cap);
+            if (u->ops == NULL) {
+                die("editorUndoRecord::realloc");
+            }
+        }
+        struct undoOp *op = &u->ops[u->nops++];
+        op->type = type;
+        op->group = u->group;
+        op->row = row;
+        op->col = col;
+        op->n = rows;
+        op->off = u->text.len;
+        op->len = total;
+        op->cx = op->ax = u->cx;
+        op->cy = op->ay = u->cy;
+        memcpy(&u->text.b[u->text.len], s, len);
+        if (rows) {
+            u->text.b[u->text.len + len] = '\n';
+        }
+        u->text.len += total;
+    }
+    u->applied = u->nops;
+    editorUndoTrim();
+}
+
+void editorUndoBoundary(int key) {
+    // Called before each key is handled. Keys of a run of typing, of
+    // backspaces or of deletes make one group; any other key starts
+    // a new one.
+    struct undoLog *u = &E.undo;
+    int kind = UNDO_KEY_OTHER;
+    if (key == BACKSPACE || key == CTRL_KEY('h')) {
+        kind = UNDO_KEY_BACKSPACE;
+    } else if (key == DEL_KEY) {
+        kind = UNDO_KEY_DELETE;
+    } else if (key == '\t' || key < 0 || (key >= ' ' && key < BACKSPACE) ||
+               (key > BACKSPACE && key < ARROW_LEFT)) {
+        // Bytes from 0x80 on are parts of UTF-8 chars, typed as well
+        kind = UNDO_KEY_TYPE;
+    }
+
+    // Where the cursor ended up after the group so far, for redo
+    if (u->applied == u->nops && u->nops > 0 && u->ops[u->nops - 1].group == u->group) {
+        u->ops[u->nops - 1].ax = E.cx;
+        u->ops[u->nops - 1].ay = E.cy;
+    }
+    if (kind == UNDO_KEY_OTHER || kind != u->key) {
+        u->group++;
+        u->cx = E.cx;
+        u->cy = E.cy;
+    }
+    u->key = kind;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    // Rows don't know their index, so the rows after `at` are left
+    // as they are: only the counts on the way down the tree change
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
+    editorUndoRecord(UNDO_INSERT_ROWS, at, 0, s, len);
+    erow *row = rowTreeInsert(at);
+    editorSyntaxRowsInserted(at, 1);
+
+    row->size = len;
+    row->cap = slabRound(len + 1);
+    row->chars = slabAlloc(row->cap);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+
+    row->view = NULL;
+    row->hl_open_comment = 0;
+    row->hl_start = 0;
+    row->hl_cached = 0;
+    row->mapped = 0;
+    editorUpdateRow(at);
+
+    E.numrows++;
+    E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+    editorRowFreeView(row);
+    if (!row->mapped) {
+        slabFree(row->chars, row->cap);
+    }
+}
+
+void editorRowReserve(erow *row, int n) {
+    // Make room for n bytes in chars, doubling so that typing doesn't
+    // allocate each time. A row still pointing into the file mapping
+    // gets its own copy of the text, so that it can be edited.
+    if (row->mapped && n < row->size + 1) {
+        n = row->size + 1;
+    }
+    if (n <= row->cap) {
+        return;
+    }
+    int cap = row->cap ? row->cap : 16;
+    while (cap < n) {
+        cap *= 2;
+    }
+    cap = slabRound(cap);
+    if (row->mapped) {
+        char *chars = slabAlloc(cap);
+        memcpy(chars, row->chars, row->size);
+        chars[row->size] = '\0';
+        row->chars = chars;
+    } else {
+        row->chars = slabRealloc(row->chars, row->cap, cap);
+    }
+    row->cap = cap;
+    row->mapped = 0;
+}
+
+void editorRowSplice(int filerow, int at, int del, const char *s, int len) {
+    // Replace the del chars at `at` of row filerow with the len chars
+    // of s, moving the rest of chars in place. If the row has a view,
+    // the new chars get a plain run in hl and its width is patched: it
+    // only changes by what the chars up to the first tab after the
+    // edit take, past that tab the columns move by whole tab stops.
+    editorFindTouch(filerow);
+    erow *row = editorRowAt(filerow);
+    struct rowView *v = row->view;
+    int r0 = 0;
+    int r1 = 0;
+    int end = at + del;
+    if (v) {
+        r0 = editorRowCxToRx(row, at);
+        const char *tab = memchr(&row->chars[end], '\t', row->size - end);
+        if (tab) {
+            end = tab - row->chars + 1;
+        }
+        r1 = r0;
+        for (int j = at; j < end; j++) {
+            if (row->chars[j] == '\t') {
+                r1 += (TAB_STOP - 1) - (r1 % TAB_STOP);
+            }
+            r1++;
+        }
+    }
+
+    int size = row->size + len - del;
+    editorRowReserve(row, size + 1);
+    memmove(&row->chars[at + len], &row->chars[at + del], row->size - at - del + 1);
+    if (len) {
+        memcpy(&row->chars[at], s, len);
+    }
+    if (v && v->hl) {
+        editorRowSetHl(row, at, at + del, NULL, len);
+    }
+    row->size = size;
+
+    if (v) {
+        end += len - del;
+        int nr1 = r0;
+        for (int j = at; j < end; j++) {
+            if (row->chars[j] == '\t') {
+                nr1 += (TAB_STOP - 1) - (nr1 % TAB_STOP);
+            }
+            nr1++;
+        }
+        v->rsize += nr1 - r1;
+        if (v->rxvalid > at / RX_CHECKPOINT + 1) {
+            v->rxvalid = at / RX_CHECKPOINT + 1;
+        }
+
+        // The colors of the new chars are stale, add them to the
+        // stale range moved by the edit
+        if (v->hl_from < 0) {
+            v->hl_from = at;
+            v->hl_to = at + len;
+        } else {
+            int from = v->hl_from;
+            int to = v->hl_to;
+            if (from >= at + del) {
+                from += len - del;
+            }
+            if (to >= at + del) {
+                to += len - del;
+            } else if (to > at) {
+                to = at + len;
+            }
+            v->hl_from = from < at ? from : at;
+            v->hl_to = to > at + len ? to : at + len;
+        }
+    }
+    // hl is kept if it was for the same start state, only the end
+    // state of the row has to be found again
+    row->hl_cached &= HL_CACHE_HL;
+    row->hl_tf = 0;
+    editorSyntaxInvalidate(filerow);
+    editorFindRowChanged(filerow);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) {
+        return;
+    }
+    erow row = *editorRowAt(at);
+    editorUndoRecord(UNDO_DELETE_ROWS, at, 0, row.chars, row.size);
+    rowTreeDelete(at);
+    editorFreeRow(&row);
+    editorSyntaxRowsDeleted(at, 1);
+    E.numrows--;
+    E.dirty++;
+}
+
+int editorRowsAtOnce(int n) {
+    // Whether to insert or delete n rows in one go: past a leaf of
+    // them, once they outnumber the leaves, splicing leaves and building
+    // the tree again costs less than a walk down the tree per row
+    return n >= ROWS_PER_LEAF && n >= E.numrows / ROWS_PER_LEAF;
+}
+
+void editorInsertRows(int at, const char *s, size_t len) {
+    // Insert the rows of s, each followed by a newline. Many rows are
+    // given their room in the tree at once, then filled in.
+    if (at < 0 || at > E.numrows) {
+        return;
+    }
+    int n = 0;
+    for (size_t i = 0; i < len; n++) {
+        const char *nl = memchr(&s[i], '\n', len - i);
+        i = nl ? (size_t)(nl - s) + 1 : len;
+    }
+    size_t i = 0;
+    if (!editorRowsAtOnce(n)) {
+        for (int j = 0; j < n; j++) {
+            const char *nl = memchr(&s[i], '\n', len - i);
+            size_t linelen = nl ? (size_t)(nl - &s[i]) : len - i;
+            editorInsertRow(at + j, (char *)&s[i], linelen);
+            i += linelen + 1;
+        }
+        return;
+    }
+
+    rowTreeInsertRows(at, n);
+    struct rowIter it;
+    erow *row = editorRowIterStart(&it, at);
+    for (int j = 0; j < n; j++, row = editorRowIterNext(&it)) {
+        const char *nl = memchr(&s[i], '\n', len - i);
+        size_t linelen = nl ? (size_t)(nl - &s[i]) : len - i;
+        editorUndoRecord(UNDO_INSERT_ROWS, at + j, 0, &s[i], linelen);
+        row->size = linelen;
+        row->cap = slabRound(linelen + 1);
+        row->chars = slabAlloc(row->cap);
+        memcpy(row->chars, &s[i], linelen);
+        row->chars[linelen] = '\0';
+        row->view = NULL;
+        row->hl_open_comment = 0;
+        row->hl_start = 0;
+        row->hl_cached = 0;
+        row->hl_tf = 0;
+        row->mapped = 0;
+        i += linelen + 1;
+    }
+    editorSyntaxRowsInserted(at, n);
+    E.numrows += n;
+    E.dirty++;
+}
+
+void editorDelRows(int at, int n) {
+    // Delete n rows from `at` on. Many rows leave the tree at once,
+    // their memory is released after that.
+    if (at < 0 || n <= 0 || at + n > E.numrows) {
+        return;
+    }
+    if (!editorRowsAtOnce(n)) {
+        for (int j = 0; j < n; j++) {
+            erow row = *editorRowAt(at);
+            editorUndoRecord(UNDO_DELETE_ROWS, at, 0, row.chars, row.size);
+            rowTreeDelete(at);
+            editorFreeRow(&row);
+            editorSyntaxRowsDeleted(at, 1);
+        }
+    } else {
+        erow *rows = malloc(sizeof(erow) * n);
+        if (rows == NULL) {
+            die("editorDelRows::malloc");
+        }
+        struct rowIter it;
+        erow *row = editorRowIterStart(&it, at);
+        for (int j = 0; j < n; j++, row = editorRowIterNext(&it)) {
+            rows[j] = *row;
+            editorUndoRecord(UNDO_DELETE_ROWS, at, 0, row->chars, row->size);
+        }
+        rowTreeDeleteRows(at, n);
+        for (int j = 0; j < n; j++) {
+            editorFreeRow(&rows[j]);
+        }
+        free(rows);
+        editorSyntaxRowsDeleted(at, n);
+    }
+    E.numrows -= n;
+    E.dirty++;
+}
+
+void editorRowAppendString(int filerow, char *s, size_t len) {
+    // Append a string to the end of the row
+    erow *row = editorRowAt(filerow);
+    editorUndoRecord(UNDO_INSERT, filerow, row->size, s, len);
+    editorRowSplice(filerow, row->size, 0, s, len);
+    E.dirty++;
+}
+
+void editorRowInsertChar(int filerow, int at, int c) {
+    erow *row = editorRowAt(filerow);
+    if (at < 0 || at > row->size) {
+        at = row->size;
+    }
+    char ch = c;
+    editorUndoRecord(UNDO_INSERT, filerow, at, &ch, 1);
+    editorRowSplice(filerow, at, 0, &ch, 1);
+    E.dirty++;
+}
+
+void editorRowDelChar(int filerow, int at) {
+    erow *row = editorRowAt(filerow);
+    if (at < 0 || at >= row->size) {
+        return;
+    }
+    editorUndoRecord(UNDO_DELETE, filerow, at, &row->chars[at], 1);
+    editorRowSplice(filerow, at, 1, NULL, 0);
+    E.dirty++;
+}
+
+void editorRowInsertChars(int filerow, int at, const char *s, size_t len) {
+    // Insert len chars at position `at`
+    editorUndoRecord(UNDO_INSERT, filerow, at, s, len);
+    editorRowSplice(filerow, at, 0, s, len);
+    E.dirty++;
+}
+
+void editorRowDelChars(int filerow, int at, size_t len) {
+    // Delete len chars from position `at` on
+    erow *row = editorRowAt(filerow);
+    editorUndoRecord(UNDO_DELETE, filerow, at, &row->chars[at], len);
+    editorRowSplice(filerow, at, len, NULL, 0);
+    E.dirty++;
+}
+
+void editorInsertChar(int c) {
+    // Check if the cursor is on the tilde line
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        // The insert may have moved the row around in the tree
+        row = editorRowAt(E.cy);
+        editorRowDelChars(E.cy, E.cx, row->size - E.cx);
+    }
+    E.cy++;
+    E.cx = 0;
+}
+
+size_t textLineLen(const char *s, size_t len) {
+    // Length of the line at the start of s, up to a \r or \n
+    size_t i = 0;
+    while (i < len && s[i] != '\r' && s[i] != '\n') {
+        i++;
+    }
+    return i;
+}
+
+void editorInsertText(const char *s, size_t len) {
+    // Insert a block of text at the cursor, as pasted. \n, \r and
+    // \r\n all break lines.
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    erow *row = editorRowAt(E.cy);
+    size_t linelen = textLineLen(s, len);
+    size_t i = linelen;
+    if (i == len) {
+        editorRowInsertChars(E.cy, E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    // Cut the row at the cursor, the tail goes after the text
+    size_t taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    if (tail == NULL) {
+        die("editorInsertText::malloc");
+    }
+    memcpy(tail, &row->chars[E.cx], taillen);
+    editorRowDelChars(E.cy, E.cx, taillen);
+    editorRowAppendString(E.cy, (char *)s, linelen);
+
+    int added = 0;
+    char *last = NULL;
+    while (i < len) {
+        // Skip the line break
+        if (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') {
+            i++;
+        }
+        i++;
+        linelen = textLineLen(&s[i], len - i);
+        int at = E.cy + 1 + added;
+        if (i + linelen == len) {
+            // The last line gets the tail of the row cut at the cursor
+            char *new = realloc(last, linelen + taillen + 1);
+            if (new == NULL) {
+                die("editorInsertText::realloc");
+            }
+            last = new;
+            memcpy(last, &s[i], linelen);
+            memcpy(&last[linelen], tail, taillen);
+            editorInsertRow(at, last, linelen + taillen);
+        } else {
+            editorInsertRow(at, (char *)&s[i], linelen);
+        }
+        added++;
+        i += linelen;
+    }
+    E.cy += added;
+    E.cx = linelen;
+    free(last);
+    free(tail);
+}
+
+void editorUndoApply(struct undoOp *op, int undo) {
+    // Make the edit of op again, or take it back
+    const char *s = &E.undo.text.b[op->off];
+    int insert = (op->type == UNDO_INSERT || op->type == UNDO_INSERT_ROWS) != undo;
+    if (op->type == UNDO_INSERT || op->type == UNDO_DELETE) {
+        if (insert) {
+            editorRowInsertChars(op->row, op->col, s, op->len);
+        } else {
+            editorRowDelChars(op->row, op->col, op->len);
+        }
+    } else if (insert) {
+        editorInsertRows(op->row, s, op->len);
+    } else {
+        editorDelRows(op->row, op->n);
+    }
+}
+
+void editorUndo() {
+    // Take back the last group of edits, newest first. The cursor
+    // goes back where it was before them.
+    struct undoLog *u = &E.undo;
+    if (u->applied == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    unsigned int group = u->ops[u->applied - 1].group;
+    u->replay = 1;
+    while (u->applied > 0 && u->ops[u->applied - 1].group == group) {
+        u->applied--;
+        editorUndoApply(&u->ops[u->applied], 1);
+    }
+    u->replay = 0;
+    E.cx = u->ops[u->applied].cx;
+    E.cy = u->ops[u->applied].cy;
+}
+
+void editorRedo() {
+    // Make the next group of undone edits again
+    struct undoLog *u = &E.undo;
+    if (u->applied == u->nops) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    unsigned int group = u->ops[u->applied].group;
+    u->replay = 1;
+    while (u->applied < u->nops && u->ops[u->applied].group == group) {
+        editorUndoApply(&u->ops[u->applied], 0);
+        u->applied++;
+    }
+    u->replay = 0;
+    E.cx = u->ops[u->applied - 1].ax;
+    E.cy = u->ops[u->applied - 1].ay;
+}
+
+void editorDelChar() {
+    // Cursor past the end of the file
+    if (E.cy == E.numrows) {
+        return;
+    }
+    // Cursor at the beginning of the first line
+    if (E.cx == 0 && E.cy == 0) {
+        return;
+    }
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorRowDelChar(E.cy, E.cx - 1);
+        E.cx--;
+    } else { // Cursor at the beginning of a line
+        erow *prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size;
+        editorRowAppendString(E.cy - 1, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+// Below this size a file is indexed by a single job
+#define INDEX_CHUNK_MIN (4 << 20)
+
+// A line-aligned piece of the file and the leaves found in it
+struct indexChunk {
+    const char *start;
+    const char *end;
+    rowNode **leaves;
+    int nleaves;
+};
+
+void editorIndexChunk(void *arg) {
+    // Split a chunk in leaves of ROWS_PER_LEAF lines. Only line
+    // boundaries are looked for here: the rows of a leaf are
+    // built when one of them is first needed.
+    struct indexChunk *chunk = arg;
+    const char *p = chunk->start;
+    int cap = 0;
+
+    while (p < chunk->end) {
+        rowNode *leaf = calloc(1, sizeof(rowNode));
+        if (leaf == NULL) {
+            die("editorIndexChunk::calloc");
+        }
+        leaf->leaf = 1;
+        leaf->text = p;
+        p = scanLines(p, chunk->end, ROWS_PER_LEAF, &leaf->n, &leaf->text_cr);
+        if (p == chunk->end && p[-1] != '\n') {
+            leaf->n++; // Last line of the file, without a newline
+        }
+        leaf->count = leaf->n;
+        leaf->textlen = p - leaf->text;
+
+        if (chunk->nleaves == cap) {
+            cap = cap ? cap * 2 : 64;
+            chunk->leaves = realloc(chunk->leaves, sizeof(rowNode *) * cap);
+            if (chunk->leaves == NULL) {
+                die("editorIndexChunk::realloc");
+            }
+        }
+        chunk->leaves[chunk->nleaves++] = leaf;
+    }
+}
+
+void editorIndexLines() {
+    // Cut the file in line-aligned chunks, index them in parallel
+    // and stitch their leaves together in order. Leaves at the end
+    // of a chunk may hold fewer than ROWS_PER_LEAF lines, which is
+    // fine for the row tree.
+    int nchunks = 1;
+    if (E.maplen > INDEX_CHUNK_MIN) {
+        poolInit(sysconf(_SC_NPROCESSORS_ONLN));
+        nchunks = pool.nthreads * 4;
+        if ((size_t)nchunks > E.maplen / INDEX_CHUNK_MIN) {
+            nchunks = E.maplen / INDEX_CHUNK_MIN;
+        }
+    }
+
+    struct indexChunk *chunks = calloc(nchunks, sizeof(struct indexChunk));
+    if (chunks == NULL) {
+        die("editorIndexLines::calloc");
+    }
+    const char *mapend = E.map + E.maplen;
+    const char *p = E.map;
+    for (int j = 0; j < nchunks; j++) {
+        chunks[j].start = p;
+        if (j == nchunks - 1) {
+            p = mapend;
+        } else {
+            // Move the cut right after the next newline
+            const char *cut = E.map + E.maplen / nchunks * (j + 1);
+            const char *nl = cut > p ? memchr(cut, '\n', mapend - cut) : NULL;
+            p = nl ? nl + 1 : (cut > p ? mapend : p);
+        }
+        chunks[j].end = p;
+    }
+
+    if (nchunks == 1) {
+        editorIndexChunk(&chunks[0]);
+    } else {
+        int pending = 0;
+        for (int j = 0; j < nchunks; j++) {
+            poolSubmit(editorIndexChunk, &chunks[j], &pending);
+        }
+        poolWait(&pending);
+    }
+
+    int nleaves = 0;
+    for (int j = 0; j < nchunks; j++) {
+        nleaves += chunks[j].nleaves;
+    }
+    rowNode **leaves = malloc(sizeof(rowNode *) * (nleaves + 1));
+    if (leaves == NULL) {
+        die("editorIndexLines::malloc");
+    }
+    E.numrows = 0;
+    nleaves = 0;
+    for (int j = 0; j < nchunks; j++) {
+        for (int k = 0; k < chunks[j].nleaves; k++) {
+            E.numrows += chunks[j].leaves[k]->n;
+            leaves[nleaves++] = chunks[j].leaves[k];
+        }
+        free(chunks[j].leaves);
+    }
+    free(chunks);
+
+    rowTreeBuild(leaves, nleaves);
+    free(leaves);
+}
+
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die("editorOpen::open");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        die("editorOpen::fstat");
+    }
+
+    // Regular files are mapped in memory, so nothing is read before
+    // a row is looked at and unedited rows are never copied.
+    // Anything else (pipes, devices...) is read in one go.
+    E.map = NULL;
+    E.maplen = 0;
+    E.map_is_mmap = 0;
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) {
+            E.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (E.map == MAP_FAILED) {
+                die("editorOpen::mmap");
+            }
+            E.maplen = st.st_size;
+            E.map_is_mmap = 1;
+        }
+    } else {
+        size_t cap = 0;
+        ssize_t nread;
+        do {
+            if (E.maplen == cap) {
+                cap = cap ? cap * 2 : 65536;
+                E.map = realloc(E.map, cap);
+                if (E.map == NULL) {
+                    die("editorOpen::realloc");
+                }
+            }
+            nread = read(fd, &E.map[E.maplen], cap - E.maplen);
+            if (nread == -1 && errno != EINTR) {
+                die("editorOpen::read");
+            }
+            if (nread > 0) {
+                E.maplen += nread;
+            }
+        } while (nread != 0);
+    }
+    close(fd);
+
+    editorIndexLines();
+    E.dirty = 0;
+}
+
+void editorMapDetach(size_t from, size_t to) {
+    // Give the pages of the file mapping holding bytes from..to a
+    // private copy, so that overwriting them in the file leaves the
+    // rows still pointing into them as they were. Writing a byte back
+    // onto itself is enough for the kernel to copy its page.
+    if (!E.map_is_mmap) {
+        return;
+    }
+    if (to > E.maplen) {
+        to = E.maplen;
+    }
+    if (from >= to) {
+        return;
+    }
+    long page = sysconf(_SC_PAGESIZE);
+    from -= from % page;
+    if (mprotect(&E.map[from], to - from, PROT_READ | PROT_WRITE) == -1) {
+        die("editorMapDetach::mprotect");
+    }
+    for (size_t off = from; off < to; off += page) {
+        volatile char *p = &E.map[off];
+        *p = *p;
+    }
+    mprotect(&E.map[from], to - from, PROT_READ);
+}
+
+void saveAppend(struct saveJob *job, const char *s, size_t len) {
+    // Add s to the text to write, growing the last iovec when s
+    // directly follows it (rows next to each other in the mapping or
+    // in the copy), so that unedited stretches go out in one piece.
+    if (job->iovcnt > 0) {
+        struct iovec *last = &job->iov[job->iovcnt - 1];
+        if ((const char *)last->iov_base + last->iov_len == s && last->iov_len + len <= SAVE_CHUNK) {
+            last->iov_len += len;
+            job->total += len;
+            return;
+        }
+    }
+    if (job->iovcnt == job->iovcap) {
+        job->iovcap = job->iovcap ? job->iovcap * 2 : 256;
+        job->iov = realloc(job->iov, sizeof(struct iovec) * job->iovcap);
+        if (job->iov == NULL) {
+            die("saveAppend::realloc");
+        }
+    }
+    job->iov[job->iovcnt].iov_base = (char *)s;
+    job->iov[job->iovcnt].iov_len = len;
+    job->iovcnt++;
+    job->total += len;
+}
+
+void editorSaveSnapshot(struct saveJob *job) {
+    // Describe the file as it is now. Leaves never loaded and rows
+    // never edited are in the file mapping, which stays as it is
+    // (the file is replaced, or the pages it's overwritten in are
+    // detached first, see editorSaveDetach()), so they are written
+    // from there. Only edited rows are copied, as they can change
+    // while the worker writes.
+    size_t ncopy = 0;
+    rowNode *leaf;
+    for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        for (int j = 0; leaf->rows && j < leaf->n; j++) {
+            if (!leaf->rows[j].mapped) {
+                ncopy += leaf->rows[j].size + 1;
+            }
+        }
+    }
+    job->copy = malloc(ncopy + 1);
+    if (job->copy == NULL) {
+        die("editorSaveSnapshot::malloc");
+    }
+
+    char *p = job->copy;
+    for (leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        if (leaf->rows == NULL && !leaf->text_cr) {
+            // The text already is the rows joined by newlines, only
+            // the last line of the file may not have one.
+            saveAppend(job, leaf->text, leaf->textlen);
+            if (leaf->text[leaf->textlen - 1] != '\n') {
+                saveAppend(job, "\n", 1);
+            }
+            continue;
+        }
+        if (leaf->rows == NULL) {
+            size_t off = 0, linelen;
+            for (int j = 0; j < leaf->n; j++) {
+                const char *line = &leaf->text[off];
+                off += rowNextLine(line, leaf->textlen - off, &linelen);
+                saveAppend(job, line, linelen);
+                saveAppend(job, "\n", 1);
+            }
+            continue;
+        }
+        for (int j = 0; j < leaf->n; j++) {
+            erow *row = &leaf->rows[j];
+            if (!row->mapped) {
+                memcpy(p, row->chars, row->size);
+                p[row->size] = '\n';
+                saveAppend(job, p, row->size + 1);
+                p += row->size + 1;
+            } else if (row->chars + row->size < E.map + E.maplen && row->chars[row->size] == '\n') {
+                saveAppend(job, row->chars, row->size + 1);
+            } else {
+                saveAppend(job, row->chars, row->size);
+                saveAppend(job, "\n", 1);
+            }
+        }
+    }
+}
+
+int editorSaveStream(struct saveJob *job, int fd) {
+    // Write the snapshot to fd in batches, counting the bytes for the
+    // progress timer, and make sure it's on disk. Returns -1 on error.
+    int i = 0;
+    while (i < job->iovcnt) {
+        int n = 0;
+        size_t bytes = 0;
+        while (i + n < job->iovcnt && n < SAVE_IOV_BATCH && bytes < SAVE_CHUNK) {
+            bytes += job->iov[i + n].iov_len;
+            n++;
+        }
+        if (writeAll(fd, &job->iov[i], n) == -1) {
+            return -1;
+        }
+        i += n;
+
+        pthread_mutex_lock(&job->lock);
+        job->written += bytes;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return fsync(fd);
+}
+
+void editorSaveDetach(struct saveJob *job) {
+    // Before the file is overwritten, detach the pages of the mapping
+    // the new contents differ from, so that the snapshot (and the
+    // rows) can still be read from there: the stretches written back
+    // where they came from cost nothing. Pages cut off by a shorter
+    // file go too, reading them would fault.
+    size_t off = 0, done = 0;
+    for (int i = 0; i < job->iovcnt; i++) {
+        const char *base = job->iov[i].iov_base;
+        size_t len = job->iov[i].iov_len;
+        if (base != E.map + off && off + len > done) {
+            editorMapDetach(off > done ? off : done, off + len);
+            done = off + len;
+        }
+        off += len;
+    }
+    editorMapDetach(off > done ? off : done, E.maplen);
+}
+
+int editorSaveInPlace(struct saveJob *job) {
+    // Overwrite the file itself, for when it can't be replaced: it
+    // keeps its inode, so its owner, links, ACLs and xattrs too. The
+    // old contents stay until the new ones are written, but a crash
+    // halfway through leaves a mix of both.
+    // Returns 0 or the errno of the step that failed.
+    int fd = open(job->path, O_WRONLY | O_CREAT, job->mode);
+    if (fd == -1) {
+        return errno;
+    }
+    editorSaveDetach(job);
+    int ok = ftruncate(fd, job->total) != -1 && editorSaveStream(job, fd) != -1;
+    int err = ok ? 0 : errno;
+    if (close(fd) == -1 && ok) {
+        err = errno;
+    }
+    return err;
+}
+
+int editorSaveOwn(struct saveJob *job, int fd) {
+    // Give the temp file the owner and group of the file it replaces.
+    // Not being in the group is no reason to fail the save: the file
+    // stays ours with our group, which we can change back. Returns -1
+    // on error.
+    if (job->uid == (uid_t)-1 || fchown(fd, job->uid, job->gid) != -1) {
+        return 0;
+    }
+    if (errno == EPERM && fchown(fd, job->uid, -1) != -1) {
+        return 0;
+    }
+    return -1;
+}
+
+char *editorSaveDir(const char *path) {
+    // The directory holding path, to be freed
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return strdup(".");
+    }
+    if (slash == path) {
+        return strdup("/");
+    }
+    return strndup(path, slash - path);
+}
+
+int editorSaveHasXattrs(const char *path) {
+    // Whether path has ACLs or xattrs a new file wouldn't get. The
+    // security ones are left out: the new file gets its label from
+    // the policy, as every other new file does.
+#ifdef __linux__
+    char names[4096];
+    ssize_t len = listxattr(path, names, sizeof(names));
+    if (len == -1) {
+        return errno == ERANGE;
+    }
+    for (ssize_t off = 0; off < len; off += strlen(&names[off]) + 1) {
+        if (strncmp(&names[off], "security.", 9)) {
+            return 1;
+        }
+    }
+#else
+    (void)path;
+#endif
+    return 0;
+}
+
+int editorSaveWrite(struct saveJob *job) {
+    // Write the snapshot to a temp file next to the target, make sure
+    // it's on disk and only then put it in place, so that a crash at
+    // any point leaves either the old file or the new one. Files that
+    // can't be replaced that way are overwritten instead.
+    // Returns 0 or the errno of the step that failed.
+    if (job->inplace) {
+        return editorSaveInPlace(job);
+    }
+    char *tmp = malloc(strlen(job->path) + 8);
+    if (tmp == NULL) {
+        return ENOMEM;
+    }
+    sprintf(tmp, "%s.XXXXXX", job->path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        int err = errno;
+        free(tmp);
+        return err;
+    }
+    // fchmod() after fchown(), which clears the set-user-ID and
+    // set-group-ID bits
+    int ok = editorSaveOwn(job, fd) != -1 && fchmod(fd, job->mode) != -1 &&
+        editorSaveStream(job, fd) != -1;
+    int err = ok ? 0 : errno;
+    if (close(fd) == -1 && ok) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok && rename(tmp, job->path) == -1) {
+        ok = 0;
+        err = errno;
+    }
+
+    if (ok) {
+        // Make the rename itself durable
+        char *dirname = editorSaveDir(job->path);
+        int dir = dirname ? open(dirname, O_RDONLY) : -1;
+        if (dir != -1) {
+            fsync(dir);
+            close(dir);
+        }
+        free(dirname);
+    } else {
+        unlink(tmp);
+    }
+    free(tmp);
+    return err;
+}
+
+void editorSaveWorker(void *arg) {
+    // Pool job: write the file, then tell the event loop
+    struct saveJob *job = arg;
+    int err = editorSaveWrite(job);
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    write(E.workpipe[1], "s", 1);
+}
+
+void editorSaveProgress() {
+    // Timer: show how far the save is, until it's done
+    struct saveJob *job = E.save;
+    pthread_mutex_lock(&job->lock);
+    size_t written = job->written;
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if (done) {
+        return;
+    }
+    editorSetStatusMessage("Saving... %d%%", job->total ? (int)(written * 100 / job->total) : 0);
+    E.redraw = 1;
+    editorTimerAdd(&E.save_timer, SAVE_PROGRESS_MS, editorSaveProgress);
+}
+
+void editorSaveCollect() {
+    // Report the end of the save in progress, if it's over. Edits
+    // made meanwhile still have to be saved.
+    struct saveJob *job = E.save;
+    if (job == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if (!done) {
+        return;
+    }
+    poolWait(&E.save_running);
+
+    if (E.save_timer.armed) {
+        editorTimerCancel(&E.save_timer);
+    }
+    if (job->err) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    } else {
+        if (E.dirty == job->dirty) {
+            E.dirty = 0;
+        }
+        editorSetStatusMessage("%zu bytes written to disk", job->total);
+    }
+    E.redraw = 1;
+
+    pthread_mutex_destroy(&job->lock);
+    free(job->path);
+    free(job->iov);
+    free(job->copy);
+    free(job);
+    E.save = NULL;
+}
+
+void editorSave() {
+    // Take a snapshot of the file and hand it to a worker, which
+    // streams it to disk while editing goes on
+    if (E.save) {
+        editorSetStatusMessage("Already saving, try again when it's done");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted!");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    struct saveJob *job = calloc(1, sizeof(struct saveJob));
+    if (job == NULL) {
+        die("editorSave::calloc");
+    }
+    // Replace the file a symlink points to, not the link
+    char *real = realpath(E.filename, NULL);
+    job->path = real ? real : strdup(E.filename);
+    struct stat st;
+    if (stat(job->path, &st) == 0) {
+        job->mode = st.st_mode & 07777;
+        job->uid = st.st_uid;
+        job->gid = st.st_gid;
+        // A new file in its place would leave the other links with
+        // the old contents, would lose the ACLs and xattrs, can't be
+        // given away to someone else but by root, and can't be made
+        // where we can't write
+        char *dir = editorSaveDir(job->path);
+        job->inplace = st.st_nlink > 1 || dir == NULL || access(dir, W_OK) == -1;
+        job->inplace |= st.st_uid != geteuid() && geteuid() != 0;
+        job->inplace |= editorSaveHasXattrs(job->path);
+        free(dir);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        job->mode = 0644 & ~mask;
+        job->uid = -1;
+        job->gid = -1;
+    }
+    editorSaveSnapshot(job);
+    job->dirty = E.dirty;
+    pthread_mutex_init(&job->lock, NULL);
+
+    E.save = job;
+    editorTimerAdd(&E.save_timer, SAVE_PROGRESS_MS, editorSaveProgress);
+    poolSubmit(editorSaveWorker, job, &E.save_running);
+}
+
+int reEmit(struct regex *re, int op, int x, int y) {
+    // Append an instruction and return its pc, or -1
+    if (re->n == re->cap) {
+        if (re->n == RE_MAX_INSTS) {
+            re->err = "too long";
+            return -1;
+        }
+        re->cap = re->cap ? re->cap * 2 : 64;
+        re->prog = realloc(re->prog, sizeof(struct reInst) * re->cap);
+        if (re->prog == NULL) {
+            die("reEmit::realloc");
+        }
+    }
+    re->prog[re->n].op = op;
+    re->prog[re->n].x = x;
+    re->prog[re->n].y = y;
+    return re->n++;
+}
+
+int reInsert(struct regex *re, int at, int op, int x, int y) {
+    // Insert an instruction before prog[at]. Targets are relative and
+    // nothing jumps across `at` yet, so none of them needs fixing.
+    if (reEmit(re, RE_MATCH, 0, 0) == -1) {
+        return -1;
+    }
+    memmove(&re->prog[at + 1], &re->prog[at], sizeof(struct reInst) * (re->n - 1 - at));
+    re->prog[at].op = op;
+    re->prog[at].x = x;
+    re->prog[at].y = y;
+    return 0;
+}
+
+int reNewSet(struct regex *re) {
+    re->sets = realloc(re->sets, sizeof(re->sets[0]) * (re->nsets + 1));
+    if (re->sets == NULL) {
+        die("reNewSet::realloc");
+    }
+    memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+    return re->nsets++;
+}
+
+void reSetAdd(uint32_t *set, int lo, int hi) {
+    for (int b = lo; b <= hi; b++) {
+        set[b >> 5] |= 1u << (b & 31);
+    }
+}
+
+int reSetEscape(uint32_t *set, char c) {
+    // Add the bytes of \d, \w, \s or their negation \D, \W, \S to set.
+    // Returns 0 if c isn't one of those.
+    uint32_t t[8] = {0};
+    switch (tolower((unsigned char)c)) {
+        case 'd':
+            reSetAdd(t, '0', '9');
+            break;
+        case 'w':
+            reSetAdd(t, '0', '9');
+            reSetAdd(t, 'A', 'Z');
+            reSetAdd(t, 'a', 'z');
+            reSetAdd(t, '_', '_');
+            break;
+        case 's':
+            reSetAdd(t, '\t', '\r');
+            reSetAdd(t, ' ', ' ');
+            break;
+        default:
+            return 0;
+    }
+    for (int k = 0; k < 8; k++) {
+        set[k] |= isupper((unsigned char)c) ? ~t[k] : t[k];
+    }
+    return 1;
+}
+
+int reParseClass(struct regex *re) {
+    // [...] with ranges and escapes, negated by a leading ^. A ] right
+    // after the [ or the ^ is taken literally.
+    int set = reNewSet(re);
+    int neg = 0;
+    if (*re->p == '^') {
+        neg = 1;
+        re->p++;
+    }
+    int first = 1;
+    while (*re->p != ']' || first) {
+        first = 0;
+        if (*re->p == '\0') {
+            re->err = "unterminated [";
+            return -1;
+        }
+        int lo = (unsigned char)*re->p++;
+        if (lo == '\\') {
+            if (*re->p == '\0') {
+                re->err = "trailing \\";
+                return -1;
+            }
+            if (reSetEscape(re->sets[set], *re->p)) {
+                re->p++;
+                continue;
+            }
+            lo = *re->p == 't' ? '\t' : (unsigned char)*re->p;
+            re->p++;
+        }
+        int hi = lo;
+        if (re->p[0] == '-' && re->p[1] != ']' && re->p[1] != '\0') {
+            re->p++;
+            hi = (unsigned char)*re->p++;
+            if (hi == '\\' && *re->p) {
+                hi = *re->p == 't' ? '\t' : (unsigned char)*re->p;
+                re->p++;
+            }
+            if (hi < lo) {
+                re->err = "bad range in []";
+                return -1;
+            }
+        }
+        reSetAdd(re->sets[set], lo, hi);
+    }
+    re->p++;
+    if (neg) {
+        for (int k = 0; k < 8; k++) {
+            re->sets[set][k] = ~re->sets[set][k];
+        }
+    }
+    return reEmit(re, RE_SET, set, 0) == -1 ? -1 : 0;
+}
+
+int reParseAtom(struct regex *re) {
+    int set;
+    char c = *re->p++;
+    switch (c) {
+        case '(':
+            if (++re->depth > RE_MAX_DEPTH) {
+                re->err = "too deeply nested";
+                return -1;
+            }
+            if (reParseAlt(re) == -1) {
+                return -1;
+            }
+            if (*re->p != ')') {
+                re->err = "unmatched (";
+                return -1;
+            }
+            re->p++;
+            re->depth--;
+            return 0;
+        case '[':
+            return reParseClass(re);
+        case '^':
+            return reEmit(re, re->rev ? RE_EOL : RE_BOL, 0, 0) == -1 ? -1 : 0;
+        case '$':
+            return reEmit(re, re->rev ? RE_BOL : RE_EOL, 0, 0) == -1 ? -1 : 0;
+        case '*':
+        case '+':
+        case '?':
+            re->err = "nothing to repeat";
+            return -1;
+    }
+
+    set = reNewSet(re);
+    if (c == '.') {
+        reSetAdd(re->sets[set], 0, 255);
+    } else if (c == '\\') {
+        c = *re->p++;
+        if (c == '\0') {
+            re->err = "trailing \\";
+            return -1;
+        }
+        if (!reSetEscape(re->sets[set], c)) {
+            c = c == 't' ? '\t' : c;
+            reSetAdd(re->sets[set], (unsigned char)c, (unsigned char)c);
+        }
+    } else {
+        reSetAdd(re->sets[set], (unsigned char)c, (unsigned char)c);
+    }
+    return reEmit(re, RE_SET, set, 0) == -1 ? -1 : 0;
+}
+
+int reParseRepeat(struct regex *re) {
+    // An atom followed by any number of *, + and ?
+    int s = re->n;
+    if (reParseAtom(re) == -1) {
+        return -1;
+    }
+    while (*re->p == '*' || *re->p == '+' || *re->p == '?') {
+        int len = re->n - s;
+        int err = 0;
+        switch (*re->p++) {
+            case '*': // L: split body, out; body; jmp L
+                err = reInsert(re, s, RE_SPLIT, 1, len + 2) == -1 || reEmit(re, RE_JMP, -(len + 1), 0) == -1;
+                break;
+            case '+': // L: body; split L, out
+                err = reEmit(re, RE_SPLIT, -len, 1) == -1;
+                break;
+            case '?': // split body, out; body
+                err = reInsert(re, s, RE_SPLIT, 1, len + 1) == -1;
+                break;
+        }
+        if (err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void reReverse(struct reInst *prog, int n) {
+    for (int i = 0, j = n - 1; i < j; i++, j--) {
+        struct reInst t = prog[i];
+        prog[i] = prog[j];
+        prog[j] = t;
+    }
+}
+
+int reParseAlt(struct regex *re) {
+    // Alternatives separated by |, each a sequence of repeats:
+    // split a, b; a; jmp out; b
+    int s = re->n;
+    while (*re->p && *re->p != '|' && *re->p != ')') {
+        int r = re->n;
+        if (reParseRepeat(re) == -1) {
+            return -1;
+        }
+        if (re->rev) {
+            // Move the repeat before those parsed so far. The targets
+            // are relative and stay inside the code of a repeat, or
+            // point right past it, so none of them needs fixing.
+            reReverse(&re->prog[s], r - s);
+            reReverse(&re->prog[r], re->n - r);
+            reReverse(&re->prog[s], re->n - s);
+        }
+    }
+    if (*re->p != '|') {
+        return 0;
+    }
+    re->p++;
+    if (reInsert(re, s, RE_SPLIT, 1, 0) == -1) {
+        return -1;
+    }
+    int jmp = reEmit(re, RE_JMP, 0, 0);
+    int other = re->n;
+    if (jmp == -1 || reParseAlt(re) == -1) {
+        return -1;
+    }
+    re->prog[s].y = other - s;
+    re->prog[jmp].x = re->n - jmp;
+    return 0;
+}
+
+void reFree(struct regex *re) {
+    free(re->prog);
+    free(re->sets);
+    re->prog = NULL;
+    re->sets = NULL;
+    if (re->back) {
+        reFree(re->back);
+        free(re->back);
+        re->back = NULL;
+    }
+}
+
+int reCompileProg(struct regex *re, const char *pattern, int rev) {
+    memset(re, 0, sizeof(*re));
+    re->p = pattern;
+    re->rev = rev;
+    // Unanchored runs start at pc 0, which loops over any byte before
+    // going to RE_BODY, so that a match may start anywhere.
+    int any = reNewSet(re);
+    reSetAdd(re->sets[any], 0, 255);
+    reEmit(re, RE_SPLIT, RE_BODY, 1);
+    reEmit(re, RE_SET, any, 0);
+    reEmit(re, RE_JMP, -2, 0);
+    if (reParseAlt(re) == 0) {
+        if (*re->p == ')') {
+            re->err = "unmatched )";
+        } else {
+            reEmit(re, RE_MATCH, 0, 0);
+        }
+    }
+    if (re->err) {
+        reFree(re);
+        return -1;
+    }
+
+    // Bytes that are in the same sets behave the same: the DFA has
+    // one transition per class of them instead of one per byte.
+    re->ncls = 0;
+    re->rep[0] = 0;
+    for (int b = 1; b < 256; b++) {
+        int differs = 0;
+        for (int k = 0; k < re->nsets && !differs; k++) {
+            differs = (re->sets[k][b >> 5] >> (b & 31) & 1) != (re->sets[k][(b - 1) >> 5] >> ((b - 1) & 31) & 1);
+        }
+        if (differs) {
+            re->rep[++re->ncls] = b;
+        }
+        re->cls[b] = re->ncls;
+    }
+    re->cls[0] = 0;
+    re->ncls++;
+    return 0;
+}
+
+int reCompile(struct regex *re, const char *pattern) {
+    // Compile pattern, made of literal chars, ., [...], \d \w \s (and
+    // \D \W \S), groups, |, *, + and ? and the ^ and $ anchors. On
+    // error returns -1 with re->err set. The pattern is also built
+    // right to left in re->back, which finds where matches start.
+    if (reCompileProg(re, pattern, 0) == -1) {
+        return -1;
+    }
+    re->back = malloc(sizeof(struct regex));
+    if (re->back == NULL) {
+        die("reCompile::malloc");
+    }
+    reCompileProg(re->back, pattern, 1);
+    return 0;
+}
+
+void reDfaFlush(struct reDfa *d) {
+    // Drop every state
+    d->nst = 0;
+    d->npcs = 0;
+    memset(d->hash, 0, sizeof(int) * RE_DFA_HASH);
+    for (int k = 0; k < 4; k++) {
+        d->start[k] = -1;
+    }
+    d->home = -1;
+    d->flushes++;
+}
+
+void reDfaInit(struct reDfa *d, const struct regex *re) {
+    memset(d, 0, sizeof(*d));
+    d->re = re;
+    d->hash = malloc(sizeof(int) * RE_DFA_HASH);
+    d->stack = malloc(sizeof(int) * re->n);
+    d->in = malloc(sizeof(int) * re->n);
+    d->out = malloc(sizeof(int) * re->n);
+    d->mark = calloc(re->n, sizeof(unsigned int));
+    if (d->hash == NULL || d->stack == NULL || d->in == NULL || d->out == NULL || d->mark == NULL) {
+        die("reDfaInit::malloc");
+    }
+    reDfaFlush(d);
+    if (re->back) {
+        d->back = malloc(sizeof(struct reDfa));
+        if (d->back == NULL) {
+            die("reDfaInit::malloc");
+        }
+        reDfaInit(d->back, re->back);
+    }
+}
+
+void reDfaFree(struct reDfa *d) {
+    free(d->st);
+    free(d->pcs);
+    free(d->next);
+    free(d->flags);
+    free(d->hash);
+    free(d->stack);
+    free(d->in);
+    free(d->out);
+    free(d->mark);
+    free(d->starts);
+    if (d->back) {
+        reDfaFree(d->back);
+        free(d->back);
+    }
+}
+
+int reCompareInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int reClosure(struct reDfa *d, const int *from, int n, int bol, int eol, int *out) {
+    // Follow the instructions that don't consume a byte from the pcs
+    // in `from`, and put the others reached in out, sorted. ^ is only
+    // passed at the start of a line and $ at its end; otherwise $ is
+    // kept, see reIntern().
+    const struct reInst *prog = d->re->prog;
+    int sp = 0;
+    int nout = 0;
+    if (++d->gen == 0) {
+        memset(d->mark, 0, sizeof(unsigned int) * d->re->n);
+        d->gen = 1;
+    }
+    for (int k = 0; k < n; k++) {
+        if (d->mark[from[k]] != d->gen) {
+            d->mark[from[k]] = d->gen;
+            d->stack[sp++] = from[k];
+        }
+    }
+    while (sp > 0) {
+        int pc = d->stack[--sp];
+        int to[2];
+        int nto = 0;
+        switch (prog[pc].op) {
+            case RE_SPLIT:
+                to[nto++] = pc + prog[pc].y;
+                to[nto++] = pc + prog[pc].x;
+                break;
+            case RE_JMP:
+                to[nto++] = pc + prog[pc].x;
+                break;
+            case RE_BOL:
+                if (bol) {
+                    to[nto++] = pc + 1;
+                }
+                break;
+            case RE_EOL:
+                if (eol) {
+                    to[nto++] = pc + 1;
+                } else {
+                    out[nout++] = pc;
+                }
+                break;
+            default:
+                out[nout++] = pc;
+        }
+        for (int k = 0; k < nto; k++) {
+            if (d->mark[to[k]] != d->gen) {
+                d->mark[to[k]] = d->gen;
+                d->stack[sp++] = to[k];
+            }
+        }
+    }
+    qsort(out, nout, sizeof(int), reCompareInt);
+    return nout;
+}
+
+unsigned int reHash(const int *pcs, int n, int bol) {
+    unsigned int h = 2166136261u ^ bol;
+    for (int k = 0; k < n; k++) {
+        h = (h ^ pcs[k]) * 16777619u;
+    }
+    return h;
+}
 
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            // strrchr() returns a pointer to the last occurence of the . in the filename
-            // strcmp() returns 0 if two strings are equal
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+int reIntern(struct reDfa *d, const int *pcs, int n, int bol) {
+    // The state made of the n pcs, built if it doesn't exist yet
+    int flags = bol ? RE_ST_BOL : 0;
+    unsigned int h = reHash(pcs, n, bol) & (RE_DFA_HASH - 1);
+    for (; d->hash[h]; h = (h + 1) & (RE_DFA_HASH - 1)) {
+        struct reState *s = &d->st[d->hash[h] - 1];
+        if (s->n == n && (s->flags & RE_ST_BOL) == flags && !memcmp(&d->pcs[s->off], pcs, sizeof(int) * n)) {
+            return d->hash[h] - 1;
+        }
+    }
+    if (d->nst == RE_DFA_STATES || d->npcs + n > RE_DFA_PCS) {
+        reDfaFlush(d);
+        h = reHash(pcs, n, bol) & (RE_DFA_HASH - 1);
+    }
 
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                return;
+    int ncls = d->re->ncls;
+    if (d->nst == d->stcap) {
+        d->stcap = d->stcap ? d->stcap * 2 : 16;
+        d->st = realloc(d->st, sizeof(struct reState) * d->stcap);
+        d->next = realloc(d->next, sizeof(int) * d->stcap * ncls);
+        d->flags = realloc(d->flags, d->stcap);
+        if (d->st == NULL || d->next == NULL || d->flags == NULL) {
+            die("reIntern::realloc");
+        }
+    }
+    if (d->npcs + n > d->pcscap) {
+        while (d->npcs + n > d->pcscap) {
+            d->pcscap = d->pcscap ? d->pcscap * 2 : 256;
+        }
+        d->pcs = realloc(d->pcs, sizeof(int) * d->pcscap);
+        if (d->pcs == NULL) {
+            die("reIntern::realloc");
+        }
+    }
+    memcpy(&d->pcs[d->npcs], pcs, sizeof(int) * n);
+
+    // Look ahead at what the state matches: now, or if the line ends
+    const struct reInst *prog = d->re->prog;
+    int neol = 0;
+    for (int k = 0; k < n; k++) {
+        if (prog[pcs[k]].op == RE_MATCH) {
+            flags |= RE_ST_MATCH;
+        } else if (prog[pcs[k]].op == RE_EOL) {
+            d->in[neol++] = pcs[k];
+        }
+    }
+    if (n == 0) {
+        flags |= RE_ST_DEAD;
+    }
+    int nend = reClosure(d, d->in, neol, bol, 1, d->out);
+    for (int k = 0; k < nend; k++) {
+        if (prog[d->out[k]].op == RE_MATCH) {
+            flags |= RE_ST_EOL;
+        }
+    }
+
+    struct reState *s = &d->st[d->nst];
+    s->off = d->npcs;
+    s->n = n;
+    s->flags = flags;
+    d->flags[d->nst] = flags;
+    d->npcs += n;
+    for (int c = 0; c < ncls; c++) {
+        d->next[d->nst * ncls + c] = -1;
+    }
+    d->hash[h] = d->nst + 1;
+    return d->nst++;
+}
+
+int reStart(struct reDfa *d, int anchored, int bol) {
+    // State to start matching from, at the start of a line or not
+    int k = anchored * 2 + bol;
+    if (d->start[k] == -1) {
+        int pc = anchored ? RE_BODY : 0;
+        int n = reClosure(d, &pc, 1, bol, 0, d->out);
+        int s = reIntern(d, d->out, n, bol);
+        d->start[k] = s;
+    }
+    return d->start[k];
+}
+
+int reStep(struct reDfa *d, int st, unsigned char c) {
+    // State reached from st by reading c
+    int cls = d->re->cls[c];
+    int t = d->next[st * d->re->ncls + cls];
+    if (t >= 0) {
+        return t;
+    }
+
+    const struct reInst *prog = d->re->prog;
+    int b = d->re->rep[cls];
+    int n = 0;
+    for (int k = 0; k < d->st[st].n; k++) {
+        int pc = d->pcs[d->st[st].off + k];
+        if (prog[pc].op == RE_SET && (d->re->sets[prog[pc].x][b >> 5] >> (b & 31) & 1)) {
+            d->in[n++] = pc + 1;
+        }
+    }
+    n = reClosure(d, d->in, n, 0, 0, d->out);
+    unsigned int flushes = d->flushes;
+    t = reIntern(d, d->out, n, 0);
+    // If the states were dropped meanwhile, st is gone
+    if (d->flushes == flushes) {
+        d->next[st * d->re->ncls + cls] = t;
+    }
+    return t;
+}
+
+void reHome(struct reDfa *d) {
+    // Find the bytes that leave the home state, giving up past 3.
+    // Lines have no '\n', so it doesn't count.
+    unsigned int flushes = d->flushes;
+    int home = reStart(d, 0, 0);
+    int bol = reStart(d, 0, 1);
+    int leave[256];
+    d->skiplines = !(d->flags[home] & (RE_ST_MATCH | RE_ST_EOL));
+    for (int c = 0; c < d->re->ncls; c++) {
+        leave[c] = reStep(d, home, d->re->rep[c]) != home;
+        // A line that starts elsewhere than home may match anyway
+        if (!leave[c] && reStep(d, bol, d->re->rep[c]) != home) {
+            d->skiplines = 0;
+        }
+    }
+    int n = 0;
+    for (int b = 0; b < 256; b++) {
+        if (b != '\n' && leave[d->re->cls[b]]) {
+            if (n == 3) {
+                n = -1;
+                break;
             }
-            i++;
+            d->homeset[n++] = b;
         }
     }
+    d->nhome = n;
+    if (n == -1) {
+        d->skiplines = 0;
+    }
+    // Try again next time if the states were dropped meanwhile
+    d->home = d->flushes == flushes ? home : -1;
 }
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
+int reLongest(struct reDfa *d, const char *s, int len, int i) {
+    // Length of the longest match starting at s[i], or -1
+    int st = reStart(d, 1, i == 0);
+    int best = -1;
+    for (int j = i; ; j++) {
+        int flags = d->flags[st];
+        if (flags & RE_ST_DEAD) {
+            break;
+        }
+        if (flags & RE_ST_MATCH) {
+            best = j - i;
+        }
+        if (j == len) {
+            if (flags & RE_ST_EOL) {
+                best = len - i;
+            }
+            break;
+        }
+        st = reStep(d, st, s[j]);
+    }
+    return best;
+}
+
+int reSearch(struct reDfa *d, const char *s, int len) {
+    // Whether s has a match. If it has, d->starts[i] is set for each i
+    // where one starts. A pass of the unanchored DFA looks for the end
+    // of a match: most lines stop there. Then the DFA of re->back is
+    // run from the end of the line to its start, and it is in a
+    // matching state right where matches start. Each pass reads every
+    // byte at most once, whatever the pattern.
+    if (d->home == -1) {
+        reHome(d);
+    }
+    int st = reStart(d, 0, 1);
+    const unsigned char *cls = d->re->cls;
+    int ncls = d->re->ncls;
     int j = 0;
+    for (; j < len && !(d->flags[st] & RE_ST_MATCH); j++) {
+        if (st == d->home && d->nhome != -1) {
+            j = syntaxFindAny(s, j, len, d->homeset, d->nhome);
+            if (j == len) {
+                break;
+            }
+        }
+        int t = d->next[st * ncls + cls[(unsigned char)s[j]]];
+        st = t >= 0 ? t : reStep(d, st, s[j]);
+    }
+    if (!(d->flags[st] & RE_ST_MATCH) && !(j == len && (d->flags[st] & RE_ST_EOL))) {
+        return 0;
+    }
 
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
+    if (len + 1 > d->startscap) {
+        d->startscap = (len + 1) * 2;
+        free(d->starts);
+        d->starts = malloc(d->startscap);
+        if (d->starts == NULL) {
+            die("reSearch::malloc");
         }
-        rx++;
     }
+    // Right to left, the end of the line is its start and the other
+    // way round: ^ and $ were swapped in re->back.
+    struct reDfa *b = d->back;
+    if (b->home == -1) {
+        reHome(b);
+    }
+    cls = b->re->cls;
+    ncls = b->re->ncls;
+    st = reStart(b, 0, 1);
+    int found = 0;
+    for (int i = len; ; i--) {
+        if (st == b->home && b->nhome != -1 && i > 0) {
+            // Skip the bytes that don't leave the home state: a match
+            // starts before them if one starts at i
+            int k = syntaxFindAnyBack(s, i, b->homeset, b->nhome) + 1;
+            if (k == 0) {
+                k = 1;
+            }
+            memset(&d->starts[k], (b->flags[st] & RE_ST_MATCH) != 0, i - k + 1);
+            i = k;
+        }
+        int flags = b->flags[st];
+        d->starts[i] = (flags & RE_ST_MATCH) || (i == 0 && (flags & RE_ST_EOL));
+        found |= d->starts[i];
+        if (i == 0) {
+            break;
+        }
+        int t = b->next[st * ncls + cls[(unsigned char)s[i - 1]]];
+        st = t >= 0 ? t : reStep(b, st, s[i - 1]);
+    }
+    return found;
+}
 
-    return rx;
+const char *findSubstring(const char *s, size_t len, const char *q, size_t k) {
+    // First occurrence of the k > 0 chars of q in s[0..len-1], or NULL.
+    // 16 positions are tried at once: only those where both the first
+    // and the last char of q are found get compared in full.
+    if (k > len) {
+        return NULL;
+    }
+    size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(q[0]);
+    const __m128i last = _mm_set1_epi8(q[k - 1]);
+    for (; i + k - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&s[i + k - 1]);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(&s[i + bit + 1], q + 1, k - 1)) {
+                return &s[i + bit];
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + k <= len; i++) {
+        if (s[i] == q[0] && !memcmp(&s[i], q, k)) {
+            return &s[i];
+        }
+    }
+    return NULL;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
+void findAddHit(struct findJob *job, int row, int col, int len) {
+    if (job->nhits == job->cap) {
+        job->cap = job->cap ? job->cap * 2 : 64;
+        job->hits = realloc(job->hits, sizeof(struct findMatch) * job->cap);
+        if (job->hits == NULL) {
+            die("findAddHit::realloc");
         }
-        cur_rx++;
-        if (cur_rx > rx) {
-            return cx;
+    }
+    job->hits[job->nhits].row = row;
+    job->hits[job->nhits].col = col;
+    job->hits[job->nhits].len = len;
+    job->nhits++;
+}
+
+void findLine(struct findJob *job, int row, const char *s, int len) {
+    // Matches of the literal query in one line
+    const char *p = s;
+    const char *m;
+    while ((m = findSubstring(p, s + len - p, job->query, job->qlen))) {
+        findAddHit(job, row, m - s, job->qlen);
+        p = m + job->qlen;
+    }
+}
+
+void findText(struct findJob *job, int row, const char *s, size_t len) {
+    // Search the lines of a leaf not loaded, s holding its first row.
+    // The query has no line breaks, so it is looked for in the whole
+    // text at once and the lines are only counted up to each match.
+    const char *end = s + len;
+    const char *line = s;
+    const char *p = s;
+    const char *m;
+    while ((m = findSubstring(p, end - p, job->query, job->qlen))) {
+        const char *nl;
+        while ((nl = memchr(line, '\n', m - line))) {
+            line = nl + 1;
+            row++;
+        }
+        findAddHit(job, row, m - line, job->qlen);
+        p = m + job->qlen;
+    }
+}
+
+void findRegexLine(struct findJob *job, struct reDfa *d, int row, const char *s, int len) {
+    // Matches of the regex in one line, from the left, each the
+    // longest one where it starts. Empty matches are skipped: there
+    // would be nothing to show of them.
+    if (!reSearch(d, s, len)) {
+        return;
+    }
+    int at = 0;
+    while (at <= len) {
+        const unsigned char *start = memchr(&d->starts[at], 1, len + 1 - at);
+        if (start == NULL) {
+            break;
         }
+        at = start - d->starts;
+        int n = reLongest(d, s, len, at);
+        if (n > 0) {
+            findAddHit(job, row, at, n);
+        }
+        at += n > 0 ? n : 1;
     }
+}
 
-    return cx;
+void findRegexText(struct findJob *job, struct reDfa *d, int row, const char *s, size_t len) {
+    // Search the lines of a leaf not loaded, s holding its first row.
+    // When the DFA says which bytes a matching line must have, only
+    // the lines where syntaxFindAny() finds one of them are looked at.
+    if (d->home == -1) {
+        reHome(d);
+    }
+    size_t off = 0;
+    while (off < len) {
+        if (d->home != -1 && d->skiplines) {
+            size_t at = syntaxFindAny(s, off, len, d->homeset, d->nhome);
+            if (at == len) {
+                break;
+            }
+            const char *nl;
+            while ((nl = memchr(&s[off], '\n', at - off))) {
+                off = nl + 1 - s;
+                row++;
+            }
+        }
+        // Lines are cut like rowLeafLoad() does
+        size_t linelen;
+        size_t next = rowNextLine(&s[off], len - off, &linelen);
+        findRegexLine(job, d, row, &s[off], linelen);
+        off += next;
+        row++;
+    }
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
+void editorFindWorker(void *arg) {
+    // Pool job: collect the matches in the leaves of job, unless a
+    // newer query came, then hand it back through E.find.done.
+    struct findJob *job = arg;
+    int row = job->first_row;
+    // Each job builds its own DFA, so workers share nothing. The main
+    // thread already checked that the regex compiles.
+    struct regex re;
+    struct reDfa dfa;
+    if (job->regex && reCompile(&re, job->query) == 0) {
+        reDfaInit(&dfa, &re);
+    } else {
+        job->regex = 0;
+    }
+    for (int k = 0; k < job->nleaves; k++) {
+        pthread_mutex_lock(&E.find.lock);
+        int stale = job->gen != E.find.gen;
+        pthread_mutex_unlock(&E.find.lock);
+        if (stale) {
+            break;
+        }
+        if (job->regex && job->text[k]) {
+            findRegexText(job, &dfa, row, job->text[k], job->textlen[k]);
+        } else if (job->regex) {
+            for (int j = 0; j < job->n[k]; j++) {
+                findRegexLine(job, &dfa, row + j, job->rows[k][j].chars, job->rows[k][j].size);
+            }
+        } else if (job->text[k]) {
+            findText(job, row, job->text[k], job->textlen[k]);
+        } else {
+            for (int j = 0; j < job->n[k]; j++) {
+                findLine(job, row + j, job->rows[k][j].chars, job->rows[k][j].size);
+            }
         }
+        row += job->n[k];
+    }
+    if (job->regex) {
+        reDfaFree(&dfa);
+        reFree(&re);
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
+    pthread_mutex_lock(&E.find.lock);
+    job->next = E.find.done;
+    E.find.done = job;
+    if (job->next == NULL) {
+        write(E.workpipe[1], "f", 1);
+    }
+    pthread_mutex_unlock(&E.find.lock);
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) {
-                row->render[idx++] = ' ';
+void editorFindJobFree(struct findJob *job) {
+    free(job->query);
+    free(job->hits);
+    free(job);
+}
+
+int editorFindLocate(int row, int col) {
+    // Index of the first match at or after (row, col)
+    int lo = 0;
+    int hi = E.find.nmatch;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct findMatch *m = &E.find.match[mid];
+        if (m->row < row || (m->row == row && m->col < col)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int editorFindAtCursor() {
+    // Index of the match the cursor is on, or -1
+    int i = editorFindLocate(E.cy, E.cx + 1) - 1;
+    if (i >= 0 && E.find.match[i].row == E.cy && E.cx < E.find.match[i].col + E.find.match[i].len) {
+        return i;
+    }
+    return -1;
+}
+
+void editorFindReserve(int n) {
+    // Make room for n more matches in the index
+    if (E.find.nmatch + n > E.find.matchcap) {
+        while (E.find.nmatch + n > E.find.matchcap) {
+            E.find.matchcap = E.find.matchcap ? E.find.matchcap * 2 : 256;
+        }
+        E.find.match = realloc(E.find.match, sizeof(struct findMatch) * E.find.matchcap);
+        if (E.find.match == NULL) {
+            die("editorFindReserve::realloc");
+        }
+    }
+}
+
+void editorFindPrompt() {
+    // The prompt tells the search mode, why the regex is rejected, or
+    // that a step back waits for the end of the file
+    const char *help = E.find.regex ? "ESC/Enter to cancel, Arrows to navigate, Ctrl-R = literal" :
+        "ESC/Enter to cancel, Arrows to navigate, Ctrl-R = regex";
+    snprintf(E.find.prompt, sizeof(E.find.prompt), "%s: %%s (%s)",
+        E.find.regex ? "Regex" : "Search", E.find.err ? E.find.err : E.find.wrap ? "search wrapping..." : help);
+}
+
+void editorFindShow() {
+    // Move the cursor to the current match
+    E.cy = E.find.match[E.find.cur].row;
+    E.cx = E.find.match[E.find.cur].col;
+    E.rowoff = E.numrows;
+    E.redraw = 1;
+}
+
+void editorFindCollect() {
+    // Take in the jobs that are done. Those of an old query are
+    // dropped. The others are added to the index in file order, so
+    // it always holds every match up to some row.
+    pthread_mutex_lock(&E.find.lock);
+    struct findJob *job = E.find.done;
+    E.find.done = NULL;
+    pthread_mutex_unlock(&E.find.lock);
+
+    while (job) {
+        struct findJob *next = job->next;
+        if (job->gen != E.find.gen) {
+            editorFindJobFree(job);
+            E.find.stale--;
+        } else {
+            job->done = 1;
+        }
+        job = next;
+    }
+    if (E.find.known < E.find.njobs && E.find.jobs[E.find.known]->done) {
+        // The matches of the rows edited must have moved before the
+        // matches of the jobs come after them
+        editorFindApplyEdits();
+    }
+    while (E.find.known < E.find.njobs && E.find.jobs[E.find.known]->done) {
+        job = E.find.jobs[E.find.known];
+        if (job->nhits) {
+            editorFindReserve(job->nhits);
+            struct findMatch *m = &E.find.match[E.find.nmatch];
+            memcpy(m, job->hits, sizeof(struct findMatch) * job->nhits);
+            for (int k = 0; k < job->nhits; k++) {
+                m[k].row += E.find.shift;
             }
+            E.find.nmatch += job->nhits;
+        }
+        editorFindJobFree(job);
+        E.find.jobs[E.find.known++] = NULL;
+        E.redraw = 1;
+    }
+    if (E.find.open && E.find.cur == -1 && E.find.nmatch > 0) {
+        E.find.cur = 0;
+        editorFindShow();
+    }
+    if (E.find.wrap && E.find.known == E.find.njobs) {
+        // The search is over: go on to the last match
+        E.find.wrap = 0;
+        editorFindPrompt();
+        editorSetStatusMessage(E.find.prompt, E.find.query);
+        if (E.find.nmatch > 0) {
+            E.find.cur = E.find.nmatch - 1;
+            editorFindShow();
+        }
+    }
+    // Once the prompt is closed, a search that found nothing is over
+    if (!E.find.open && E.find.active && E.find.known == E.find.njobs && E.find.nmatch == 0) {
+        editorFindEnd();
+    }
+}
+
+void editorFindWait(int n) {
+    // Block until the first n jobs of the query are in the index and
+    // the jobs of older queries are back. The query may end meanwhile
+    // (see editorFindCollect()), then there is nothing left to wait for.
+    while ((E.find.known < n && E.find.known < E.find.njobs) || E.find.stale > 0) {
+        struct pollfd pfd = { E.workpipe[0], POLLIN, 0 };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            die("editorFindWait::poll");
+        }
+        editorWorkCollect();
+    }
+}
+
+void editorFindCancel() {
+    // Drop the jobs and the matches of the query. Jobs still out stop
+    // at their next leaf and are freed by editorFindCollect().
+    pthread_mutex_lock(&E.find.lock);
+    E.find.gen++;
+    pthread_mutex_unlock(&E.find.lock);
+
+    for (int j = E.find.known; j < E.find.njobs; j++) {
+        if (E.find.jobs[j]->done) {
+            editorFindJobFree(E.find.jobs[j]);
+        } else {
+            E.find.stale++;
+        }
+    }
+    E.find.njobs = 0;
+    E.find.known = 0;
+    E.find.shift = 0;
+    E.find.nmatch = 0;
+    E.find.cur = -1;
+    E.find.edited = 0;
+    if (E.find.wrap) {
+        E.find.wrap = 0;
+        editorFindPrompt();
+    }
+    E.redraw = 1;
+}
+
+void editorFindEnd() {
+    // Forget the query: its matches aren't shown anymore
+    editorFindCancel();
+    free(E.find.query);
+    E.find.query = NULL;
+    if (E.find.use_regex) {
+        reDfaFree(&E.find.dfa);
+        reFree(&E.find.re);
+        E.find.use_regex = 0;
+    }
+    E.find.active = 0;
+}
+
+void editorFindApplyEdits() {
+    // Bring the index up to date with the rows edited: the matches of
+    // the rows replaced go, those after them move, and the rows of the
+    // window are searched again. Everything else is left as it is.
+    if (!E.find.edited) {
+        return;
+    }
+    E.find.edited = 0;
+    int from = E.find.edit_from;
+    int to = E.find.edit_to;
+    int delta = E.find.edit_delta;
+    int i = editorFindLocate(from, 0);
+    int j = editorFindLocate(to - delta, 0);
+
+    struct findJob scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.query = E.find.query;
+    scan.qlen = strlen(E.find.query);
+    for (int r = from; r < to; r++) {
+        erow *row = editorRowAt(r);
+        if (E.find.use_regex) {
+            findRegexLine(&scan, &E.find.dfa, r, row->chars, row->size);
         } else {
-            row->render[idx++] = row->chars[j];
+            findLine(&scan, r, row->chars, row->size);
         }
     }
-    // idx now contains the # of chars we copied into row->render
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    int removed = j - i;
+    editorFindReserve(scan.nhits - removed > 0 ? scan.nhits - removed : 0);
+    if (E.find.nmatch > j) {
+        memmove(&E.find.match[i + scan.nhits], &E.find.match[j], sizeof(struct findMatch) * (E.find.nmatch - j));
+    }
+    E.find.nmatch += scan.nhits - removed;
+    for (int k = i + scan.nhits; k < E.find.nmatch; k++) {
+        E.find.match[k].row += delta;
+    }
+    if (scan.nhits) {
+        memcpy(&E.find.match[i], scan.hits, sizeof(struct findMatch) * scan.nhits);
+    }
+    free(scan.hits);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) {
+void editorFindTouch(int at) {
+    // Row `at` or its leaf is about to change: wait for the jobs up to
+    // the one reading it, so that the index still holds every match
+    // up to some row. The jobs after it go on, the rows they read are
+    // left alone.
+    int n = E.find.known;
+    while (n < E.find.njobs && E.find.jobs[n]->first_row + E.find.shift <= at) {
+        n++;
+    }
+    editorFindWait(n);
+}
+
+void editorFindRowChanged(int at) {
+    // The text of row `at` changed. Edits next to the rows already
+    // edited widen the window, others get the index updated first.
+    if (!E.find.active) {
+        return;
+    }
+    if (E.find.edited && E.find.edit_from <= at && at <= E.find.edit_to) {
+        if (at == E.find.edit_to) {
+            E.find.edit_to++;
+        }
+        return;
+    }
+    editorFindApplyEdits();
+    E.find.edited = 1;
+    E.find.edit_from = at;
+    E.find.edit_to = at + 1;
+    E.find.edit_delta = 0;
+}
+
+void editorFindRowInserted(int at) {
+    // Called by rowTreeTouch() before the row is inserted, once the
+    // jobs up to the one reading it are back. The rows after it move
+    // down, those of the jobs not back as well.
+    E.find.shift++;
+    if (!E.find.active) {
+        return;
+    }
+    if (E.find.edited && E.find.edit_from <= at && at <= E.find.edit_to) {
+        E.find.edit_to++;
+        E.find.edit_delta++;
+        return;
+    }
+    editorFindApplyEdits();
+    E.find.edited = 1;
+    E.find.edit_from = at;
+    E.find.edit_to = at + 1;
+    E.find.edit_delta = 1;
+}
+
+void editorFindRowDeleted(int at) {
+    // Called by rowTreeTouch() before the row is deleted
+    E.find.shift--;
+    if (!E.find.active) {
+        return;
+    }
+    if (E.find.edited && E.find.edit_from <= at && at <= E.find.edit_to) {
+        // Deleting the row right after the window adds it to the rows
+        // replaced; it was never in the window
+        if (at < E.find.edit_to) {
+            E.find.edit_to--;
+        }
+        E.find.edit_delta--;
+        return;
+    }
+    editorFindApplyEdits();
+    E.find.edited = 1;
+    E.find.edit_from = at;
+    E.find.edit_to = at;
+    E.find.edit_delta = -1;
+}
+
+void editorFindSubmit(struct findJob *job) {
+    if (E.find.njobs == E.find.cap) {
+        E.find.cap = E.find.cap ? E.find.cap * 2 : 64;
+        E.find.jobs = realloc(E.find.jobs, sizeof(struct findJob *) * E.find.cap);
+        if (E.find.jobs == NULL) {
+            die("editorFindSubmit::realloc");
+        }
+    }
+    E.find.jobs[E.find.njobs++] = job;
+    poolSubmit(editorFindWorker, job, NULL);
+}
+
+void editorFindStart(const char *query) {
+    // Search the whole file for query from the top, FIND_JOB_LEAVES
+    // leaves per job. The workers take the jobs in order, so the
+    // first match tends to come in first.
+    editorFindEnd();
+    if (E.find.regex) {
+        struct regex re;
+        int ok = reCompile(&re, query) == 0;
+        E.find.err = ok ? NULL : re.err;
+        editorFindPrompt();
+        if (!ok) {
+            return;
+        }
+        reFree(&re);
+    }
+    if (query[0] == '\0') {
+        return;
+    }
+    E.find.query = strdup(query);
+    if (E.find.query == NULL) {
+        die("editorFindStart::strdup");
+    }
+    // A regex without operators is searched as it is, faster
+    if (E.find.regex && query[strcspn(query, "\\.[]()|*+?^$")]) {
+        reCompile(&E.find.re, query);
+        reDfaInit(&E.find.dfa, &E.find.re);
+        E.find.use_regex = 1;
+    }
+    E.find.active = 1;
+
+    struct findJob *job = NULL;
+    int row = 0;
+    for (rowNode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        if (job == NULL) {
+            job = calloc(1, sizeof(struct findJob));
+            if (job == NULL || (job->query = strdup(query)) == NULL) {
+                die("editorFindStart::calloc");
+            }
+            job->gen = E.find.gen;
+            job->qlen = strlen(query);
+            job->regex = E.find.use_regex;
+            job->first_row = row;
+        }
+        int k = job->nleaves++;
+        if (leaf->rows == NULL) {
+            job->text[k] = leaf->text;
+            job->textlen[k] = leaf->textlen;
+        } else {
+            job->rows[k] = leaf->rows;
+        }
+        job->n[k] = leaf->n;
+        row += leaf->n;
+        if (job->nleaves == FIND_JOB_LEAVES) {
+            editorFindSubmit(job);
+            job = NULL;
+        }
+    }
+    if (job) {
+        editorFindSubmit(job);
+    }
+}
+
+void editorFindStep(int dir) {
+    // Go to the next match in direction dir, wrapping around at the
+    // ends of the file. Matches not in the index yet are waited for,
+    // but for the last one: stepping back from the first match leaves
+    // the cursor there until editorFindCollect() has the whole file.
+    if (!E.find.active) {
+        return;
+    }
+    int cur = E.find.cur;
+    if (cur == -1) {
+        dir = 1;
+    }
+    if (E.find.wrap) {
+        E.find.wrap = 0;
+        editorFindPrompt();
+    }
+    if (dir > 0) {
+        while (cur + 1 >= E.find.nmatch && E.find.known < E.find.njobs) {
+            editorFindWait(E.find.known + 1);
+        }
+        cur = cur + 1 < E.find.nmatch ? cur + 1 : 0;
+    } else if (cur > 0) {
+        cur--;
+    } else if (E.find.known < E.find.njobs) {
+        E.find.wrap = 1;
+        editorFindPrompt();
         return;
+    } else {
+        cur = E.find.nmatch - 1;
     }
+    if (E.find.nmatch > 0) {
+        E.find.cur = cur;
+        editorFindShow();
+    }
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++)
+void editorFindStop(int keep) {
+    // The prompt is closing. With keep, the matches stay shown and are
+    // kept up to date as rows are edited, and the jobs still out go
+    // on. The jobs of older queries stop at their next leaf, they are
+    // waited for so that edits don't have to.
+    E.find.open = 0;
+    E.find.cur = -1;
+    E.find.wrap = 0;
+    if (!keep || (E.find.nmatch == 0 && E.find.known == E.find.njobs)) {
+        editorFindEnd();
+    }
+    editorFindWait(E.find.known);
+}
 
-    E.row[at].idx = at;
+void editorFindCallback(char *query, int key) {
+    if (key == '\r' && query[0] == '\0') {
+        // The prompt doesn't close on an empty query
+        return;
+    }
+    if (key == '\r' || key == '\x1b') {
+        editorFindStop(key == '\r');
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        editorFindStep(1);
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        editorFindStep(-1);
+    } else if (key == CTRL_KEY('r')) {
+        E.find.regex = !E.find.regex;
+        E.find.err = NULL;
+        editorFindPrompt();
+        editorFindStart(query);
+    } else {
+        editorFindStart(query);
+    }
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    E.find.err = NULL;
+    E.find.open = 1;
+    editorFindPrompt();
+    char *query = editorPrompt(E.find.prompt, editorFindCallback);
 
-    E.numrows++;
-    E.dirty++;
+    if (query) {
+        free(query);
+    } else { // Restore cursor position when cancelling
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+int editorInputPending() {
+    // Bytes read from the terminal and not decoded yet
+    return E.intail - E.inhead;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) {
-        return;
+int editorInputFill(int timeout) {
+    // Wait up to timeout ms (-1: forever) for input, then read as
+    // much as there is room for. Returns the number of bytes read.
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout);
+    if (ready == -1 && errno != EINTR) {
+        die("editorInputFill::poll");
     }
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) {
-        E.row[j].idx--;
+    if (ready <= 0) {
+        return 0;
     }
-    E.numrows--;
-    E.dirty++;
-}
-
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    // Append a string to the end of the row
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
-}
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) {
-        at = row->size;
+    // Free space up to the end of the ring or to the unread data
+    unsigned int room = INPUT_RING_SIZE - editorInputPending();
+    unsigned int at = E.intail & (INPUT_RING_SIZE - 1);
+    if (room > INPUT_RING_SIZE - at) {
+        room = INPUT_RING_SIZE - at;
     }
-    // Make room for the new char + null byte
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
-}
-
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) {
-        return;
+    if (room == 0) {
+        return 0;
     }
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    ssize_t nread = read(STDIN_FILENO, &E.inbuf[at], room);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) {
+        die("editorInputFill::read");
+    }
+    if (nread <= 0) {
+        return 0;
+    }
+    E.intail += nread;
+    return nread;
 }
 
-void editorInsertChar(int c) {
-    // Check if the cursor is on the tilde line
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+int editorReadByte(int timeout) {
+    // Next input byte, or -1 if none came within timeout ms
+    if (!editorInputPending() && !editorInputFill(timeout)) {
+        return -1;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return (unsigned char)E.inbuf[E.inhead++ & (INPUT_RING_SIZE - 1)];
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
-    }
-    E.cy++;
-    E.cx = 0;
+long long editorNow() {
+    // Milliseconds on a clock that doesn't jump
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-void editorDelChar() {
-    // Cursor past the end of the file
-    if (E.cy == E.numrows) {
-        return;
+// Timers live in a hashed wheel of TIMER_SLOTS lists, one per
+// TIMER_TICK ms, so adding one and finding the ones due is cheap.
+// A timer further away than a turn of the wheel stays in its slot
+// until the wheel comes around to its time. The earliest deadline
+// is kept aside for the event loop; the wheel is only searched for
+// it again once the timer that had it fired or was cancelled.
+
+void editorTimerCancel(struct editorTimer *t) {
+    struct editorTimer **p = &E.timers[t->slot];
+    while (*p && *p != t) {
+        p = &(*p)->next;
     }
-    // Cursor at the beginning of the first line
-    if (E.cx == 0 && E.cy == 0) {
-        return;
+    if (*p) {
+        *p = t->next;
     }
-
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else { // Cursor at the beginning of a line
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+    if (t->armed && t->when == E.timer_next) {
+        E.timer_next = TIMER_NEXT_STALE;
     }
+    t->armed = 0;
 }
 
-char * editorRowsToString(int *buflen) {
-    // This functions convers an array of erow structs into
-    // a single string.
-
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++) {
-        // Length of each row of text + 1 for the newline char.
-        totlen += E.row[j].size + 1;
+void editorTimerAdd(struct editorTimer *t, int ms, void (*fn)(void)) {
+    // Call fn in `ms` milliseconds. A timer already armed is moved.
+    if (t->armed) {
+        editorTimerCancel(t);
     }
-    *buflen = totlen;
-    
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        // Copy the content of each row to the end of the buffer
-        // and then append a newline char.
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    t->when = editorNow() + ms;
+    t->fn = fn;
+    t->slot = (t->when / TIMER_TICK) % TIMER_SLOTS;
+    t->next = E.timers[t->slot];
+    E.timers[t->slot] = t;
+    t->armed = 1;
+    if (E.timer_next != TIMER_NEXT_STALE && (E.timer_next == -1 || t->when < E.timer_next)) {
+        E.timer_next = t->when;
     }
-
-    return buf;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    editorSelectSyntaxHighlight();
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        die("editorOpen::fopen");
+int editorTimerNext() {
+    // Milliseconds until the next timer is due, -1 if there is none
+    if (E.timer_next == TIMER_NEXT_STALE) {
+        E.timer_next = -1;
+        for (int i = 0; i < TIMER_SLOTS; i++) {
+            for (struct editorTimer *t = E.timers[i]; t; t = t->next) {
+                if (E.timer_next == -1 || t->when < E.timer_next) {
+                    E.timer_next = t->when;
+                }
+            }
+        }
+    }
+    if (E.timer_next == -1) {
+        return -1;
     }
+    long long now = editorNow();
+    return E.timer_next <= now ? 0 : E.timer_next - now;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r')) {
-            linelen--;
+void editorTimerRun() {
+    // Fire the timers that are due, going over the slots of the
+    // ticks elapsed since last time (all of them after a long wait)
+    long long now = editorNow();
+    long long tick = E.timer_tick;
+    if (now / TIMER_TICK - tick >= TIMER_SLOTS) {
+        tick = now / TIMER_TICK - TIMER_SLOTS + 1;
+    }
+    for (; tick <= now / TIMER_TICK; tick++) {
+        struct editorTimer **p = &E.timers[tick % TIMER_SLOTS];
+        while (*p) {
+            struct editorTimer *t = *p;
+            if (t->when > now) {
+                p = &t->next;
+                continue;
+            }
+            *p = t->next;
+            t->armed = 0;
+            if (t->when == E.timer_next) {
+                E.timer_next = TIMER_NEXT_STALE;
+            }
+            t->fn();
         }
-        editorInsertRow(E.numrows, line, linelen);
     }
+    E.timer_tick = now / TIMER_TICK;
+}
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+void editorIdleAdd(int (*pending)(void), void (*run)(void)) {
+    // Register background work, run a slice at a time when there is
+    // no input to handle. pending() tells if there is work to do.
+    if (E.nidle == IDLE_MAX) {
+        return;
+    }
+    E.idle[E.nidle].pending = pending;
+    E.idle[E.nidle].run = run;
+    E.nidle++;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted!");
-            return;
+int editorIdlePending() {
+    for (int i = 0; i < E.nidle; i++) {
+        if (E.idle[i].pending()) {
+            return 1;
         }
-        editorSelectSyntaxHighlight();
     }
+    return 0;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != 1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+void editorIdleRun() {
+    // Run one slice of the next task with work to do, in turns
+    for (int i = 0; i < E.nidle; i++) {
+        struct idleTask *task = &E.idle[(E.idle_next + i) % E.nidle];
+        if (task->pending()) {
+            task->run();
+            E.idle_next = (E.idle_next + i + 1) % E.nidle;
+            return;
         }
-        close(fd);
     }
-
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+void editorHandleSigwinch(int sig) {
+    // Only tell the event loop, everything else happens there
+    (void)sig;
+    int saved = errno;
+    write(E.sigpipe[1], "w", 1);
+    errno = saved;
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+void editorHandleResize() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) {
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) {
-        direction = 1;
-    }
-    int current = last_match; // index of the current row we are searching
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = E.numrows - 1;
-        } else if (current == E.numrows) {
-            current = 0;
-        }
-        erow *row = &E.row[current];
-        // Check if query is a substring of the current row
-        char *match = strstr(row->render, query);
-        if (match) { // Query found
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
     }
+    E.screenrows = rows > 3 ? rows - 2 : 1;
+    E.screencols = cols;
+    editorScreenResize();
+    E.redraw = 1;
 }
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+void editorWorkCollect() {
+    // Take in what the workers handed back since last time
+    char buf[64];
+    while (read(E.workpipe[0], buf, sizeof(buf)) > 0) {
+    }
+    editorSyntaxCollect();
+    editorSaveCollect();
+    editorFindCollect();
+}
 
-    char *query = editorPrompt("Search: %s (ESC/Enter to cancel, Arrows to navigate)", editorFindCallback);
+void editorWaitEvent() {
+    // One turn of the event loop: wait for input, a resize, a timer
+    // or, if there is background work, nothing at all; then handle
+    // what happened and redraw if some of it is on screen.
+    int idle = editorIdlePending();
+    int timeout = idle ? 0 : editorTimerNext();
+    struct pollfd pfd[3] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.sigpipe[0], POLLIN, 0 },
+        { E.workpipe[0], POLLIN, 0 }
+    };
+
+    int ready = poll(pfd, 3, timeout);
+    if (ready == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        die("editorWaitEvent::poll");
+    }
+    if (pfd[1].revents & POLLIN) {
+        char buf[64];
+        while (read(E.sigpipe[0], buf, sizeof(buf)) > 0) {
+        }
+        editorHandleResize();
+    }
+    if (pfd[2].revents & POLLIN) {
+        editorWorkCollect();
+    }
+    editorTimerRun();
+    if (pfd[0].revents) {
+        editorInputFill(0);
+    } else if (ready == 0 && idle) {
+        editorIdleRun();
+    }
 
-    if (query) {
-        free(query);
-    } else { // Restore cursor position when cancelling
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+    if (E.redraw || E.hl_redraw) {
+        editorRefreshScreen();
     }
 }
 
 int editorReadKey() {
-    // Wait for one keypress and return it
-    int nread;
-    char c;
-
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) {
-            die("editorReadKey::read");
-        }
+    // Wait for one keypress and return it, running the event loop
+    // until one comes
+    while (!editorInputPending()) {
+        editorWaitEvent();
     }
 
+    int c = editorReadByte(0);
     if (c == '\x1b') {
-        char seq[3];
+        int seq[2];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        // The rest of a sequence comes with it, a lone <esc> doesn't
+        if ((seq[0] = editorReadByte(ESC_TIMEOUT)) == -1) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if ((seq[1] = editorReadByte(ESC_TIMEOUT)) == -1) {
             return '\x1b';
         }
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
+                int n = seq[1] - '0', next;
+                while ((next = editorReadByte(ESC_TIMEOUT)) >= '0' && next <= '9' && n < 1000) {
+                    n = n * 10 + next - '0';
                 }
                 // PAGE UP is sent as <esc>[5~
                 // PAGE DOWN is sent as <esc>[6~
                 // HOME is sent as <esc>[1~ / <esc>[7~ / <esc>[H / <esc>OH
                 // END is sent as <esc>[4~ / <esc>[8~ / <esc>[F / <esc>OF
                 // DEL is sent as <esc>[3~
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                // Pasted text starts with <esc>[200~ and ends with <esc>[201~
+                if (next == '~') {
+                    switch (n) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
+                        case 201: return PASTE_END;
                     }
                 }
             } else {
@@ -833,6 +5891,24 @@ int editorReadKey() {
     }
 }
 
+char *editorReadPaste(int *len) {
+    // Read the text pasted after a PASTE_START key, up to the
+    // closing <esc>[201~. Returns a malloc'd buffer.
+    static const char end[] = "\x1b[201~";
+    struct abuf ab = ABUF_INIT;
+    int c;
+    while ((c = editorReadByte(1000)) != -1) {
+        char ch = c;
+        abAppend(&ab, &ch, 1);
+        if (ab.len >= 6 && !memcmp(&ab.b[ab.len - 6], end, 6)) {
+            ab.len -= 6;
+            break;
+        }
+    }
+    *len = ab.len;
+    return ab.b;
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -842,10 +5918,26 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        if (!editorInputPending()) {
+            editorRefreshScreen();
+        }
 
         int c = editorReadKey();
-        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) { // Backspace/Del
+        if (c == PASTE_START) { // Pasted text, without line breaks
+            int len;
+            char *text = editorReadPaste(&len);
+            for (int j = 0; j < len; j++) {
+                if (!iscntrl((unsigned char)text[j]) && (unsigned char)text[j] < 128) {
+                    if (buflen == bufsize - 1) {
+                        bufsize *= 2;
+                        buf = realloc(buf, bufsize);
+                    }
+                    buf[buflen++] = text[j];
+                    buf[buflen] = '\0';
+                }
+            }
+            free(text);
+        } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) { // Backspace/Del
             if (buflen != 0) {
                 buf[--buflen] = '\0';
             }
@@ -880,7 +5972,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key) {
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch (key) {
         case ARROW_LEFT:
@@ -888,7 +5980,7 @@ void editorMoveCursor(int key) {
                 E.cx--;
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -911,7 +6003,7 @@ void editorMoveCursor(int key) {
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -923,11 +6015,17 @@ void editorProcessKeypress() {
 
     // Wait for a keypress and then handle it
     int c = editorReadKey();
+    editorUndoBoundary(c);
 
     // CTRL-Q will be used to quit from editor
     // CTRL-S will be used to save the file
     switch (c) {
         case CTRL_KEY('q'):
+            // Let a save in progress finish first
+            if (E.save) {
+                poolWait(&E.save_running);
+                editorSaveCollect();
+            }
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage("WARNING: file has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
                 quit_times--;
@@ -944,6 +6042,12 @@ void editorProcessKeypress() {
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
         case '\r': // Enter key
             editorInsertNewline();
             break;
@@ -952,7 +6056,7 @@ void editorProcessKeypress() {
             break;
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case BACKSPACE:
@@ -990,8 +6094,19 @@ void editorProcessKeypress() {
         case ARROW_RIGHT:
             editorMoveCursor(c);
             break;
+        case PASTE_START:
+            {
+                int len;
+                char *text = editorReadPaste(&len);
+                editorInsertText(text, len);
+                free(text);
+            }
+            break;
+        case '\x1b': // Stop showing the matches of the last search
+            editorFindEnd();
+            break;
         case CTRL_KEY('l'):
-        case '\x1b':
+        case PASTE_END:
             break;
         default:
             editorInsertChar(c);
@@ -1004,7 +6119,7 @@ void editorProcessKeypress() {
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     if (E.cy < E.rowoff) {
@@ -1021,14 +6136,61 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *ab) {
+ecell *screenRow(ecell *grid, int y) {
+    return &grid[y * E.screencols];
+}
+
+int screenPut(int y, int x, const char *s, int len, int hl, int attr) {
+    // Write len chars on screen line y from column x, cut at the
+    // right edge, and return the column after the last one written
+    ecell *row = screenRow(E.screen, y);
+    for (int j = 0; j < len && x < E.screencols; j++, x++) {
+        row[x].ch = s[j];
+        row[x].hl = hl;
+        row[x].attr = attr;
+    }
+    return x;
+}
+
+void screenClear(int y, int x) {
+    // Blank screen line y from column x to the end
+    static const ecell blank = { ' ', HL_NORMAL, 0 };
+    ecell *row = screenRow(E.screen, y);
+    for (; x < E.screencols; x++) {
+        row[x] = blank;
+    }
+}
+
+void editorScreenResize() {
+    // (Re)allocate the frame buffers for the current window size.
+    // Nothing is known about what the terminal shows at this point,
+    // so the next frame clears it and redraws everything.
+    int cells = (E.screenrows + 2) * E.screencols;
+    E.screen = realloc(E.screen, sizeof(ecell) * cells);
+    E.shadow = realloc(E.shadow, sizeof(ecell) * cells);
+    if (cells && (E.screen == NULL || E.shadow == NULL)) {
+        die("editorScreenResize::realloc");
+    }
+    E.shadow_valid = 0;
+}
+
+void editorDrawRows() {
     // Draw a column of tildes on the left hand side
     // of the screen, like vim does.
     // Or fill the screen with file lines
     int y;
 
+    // Bring the highlighter up to the last row on screen,
+    // if it's not too far behind.
+    editorSyntaxAdvance(E.rowoff + E.screenrows, HL_SYNC_ROWS, 0);
+    E.hl_redraw = 0;
+    // Matches of the search are drawn over the highlight
+    editorFindApplyEdits();
+    int m = editorFindLocate(E.rowoff, 0);
+
     for (y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
+        int x = 0;
         if (filerow >= E.numrows) {
             if (E.numrows == 0 && y == E.screenrows / 3) {
                 char welcome[80];
@@ -1038,154 +6200,385 @@ void editorDrawRows(struct abuf *ab) {
                 }
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    x = screenPut(y, x, "~", 1, HL_NORMAL, 0);
                     padding--;
                 }
-                while (padding--) {
-                    abAppend(ab, " ", 1);
-                }
-                abAppend(ab, welcome, welcomelen);
+                screenClear(y, x);
+                x = screenPut(y, x + padding, welcome, welcomelen, HL_NORMAL, 0);
             } else {
-                abAppend(ab, "~", 1);
+                x = screenPut(y, x, "~", 1, HL_NORMAL, 0);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
+            editorRowHighlight(filerow);
+            erow *row = editorRowAt(filerow);
+            struct rowView *v = row->view;
+            int len = v->rsize - E.coloff;
             if (len < 0) {
                 len = 0;
             }
             if (len > E.screencols) {
                 len = E.screencols;
             }
-            
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
+
+            // Start from the char drawn in the first column, which may
+            // be a tab that began left of it
+            int cx = editorRowRxToCx(row, E.coloff);
+            int rx = editorRowCxToRx(row, cx) - E.coloff;
+            // and from the color run holding it: left chars of the
+            // run are still to be drawn
+            int pos = 0;
+            int run = syntaxRunSeek(v->hl, v->hlruns, 0, &pos, cx);
+            int left = run < v->hlruns ? pos + (v->hl[run] >> HL_RUN_BITS) - cx : 0;
+            const struct charClasses *cc = E.syntax ? E.syntax->cclass : &charClassBase;
+            for (x = 0; x < len; cx++) {
+                if (left == 0) {
+                    left = v->hl[++run] >> HL_RUN_BITS;
+                }
+                left--;
+                int color = v->hl[run] & HL_RUN_COLOR;
+                char c = row->chars[cx];
+                ecell *cell = &E.screen[y * E.screencols + x];
+                if (c == '\t') {
+                    // Spaces up to the next tab stop
+                    int stop = rx + TAB_STOP - (rx + E.coloff) % TAB_STOP;
+                    for (; x < stop && x < len; x++, cell++) {
+                        cell->ch = ' ';
+                        cell->hl = color;
+                        cell->attr = 0;
+                    }
+                    rx = stop;
+                    continue;
+                }
                 // Non-printable chars
-                if (iscntrl(c[j])) {
+                if (cc->cls[(unsigned char)c] & CC_CONTROL) {
                     // Capital letters in ASCII comes after the @
                     // so we will add its value to @
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
+                    cell->ch = (c <= 26) ? '@' + c : '?';
+                    cell->hl = color;
+                    cell->attr = CELL_INVERSE;
                 } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    cell->ch = c;
+                    cell->hl = color;
+                    cell->attr = 0;
+                }
+                x++;
+                rx++;
+            }
+            for (; m < E.find.nmatch && E.find.match[m].row == filerow; m++) {
+                int from = editorRowCxToRx(row, E.find.match[m].col) - E.coloff;
+                int to = editorRowCxToRx(row, E.find.match[m].col + E.find.match[m].len) - E.coloff;
+                for (int k = from > 0 ? from : 0; k < to && k < len; k++) {
+                    E.screen[y * E.screencols + k].hl = HL_MATCH;
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
-
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+        screenClear(y, x);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-    // Switch to inverted colors: \x1b[7m
-    abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+    // Drawn in inverted colors
+    int y = E.screenrows;
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
         E.filename ? E.filename : "[No Name]", E.numrows,
         E.dirty ? "(modified)" : "");
-    // Filetype and line number
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->filetype : "text", E.cy + 1, E.numrows);
+    // Where the cursor is among the matches of the search. While the
+    // search goes on, N is what was found so far.
+    if (E.find.active && len < (int)sizeof(status)) {
+        int k = editorFindAtCursor();
+        const char *more = E.find.known < E.find.njobs ? "+" : "";
+        if (k >= 0) {
+            len += snprintf(&status[len], sizeof(status) - len, " - match %d of %d%s", k + 1, E.find.nmatch, more);
+        } else {
+            len += snprintf(&status[len], sizeof(status) - len, " - %d matches%s", E.find.nmatch, more);
+        }
+    }
+    if (len >= (int)sizeof(status)) {
+        len = sizeof(status) - 1;
+    }
+    // Filetype, line number and bytes sent to draw the last frame
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d | %dB", E.syntax ? E.syntax->filetype : "text",
+        E.cy + 1, E.numrows, E.frame_bytes);
     // Cut string if longer than screen size
     if (len > E.screencols) {
         len = E.screencols;
     }
-    abAppend(ab, status, len);
+    screenPut(y, 0, status, len, HL_NORMAL, CELL_INVERSE);
     while (len < E.screencols) {
         if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+            screenPut(y, len, rstatus, rlen, HL_NORMAL, CELL_INVERSE);
             break;
         } else {
-            abAppend(ab, " ", 1);
+            screenPut(y, len, " ", 1, HL_NORMAL, CELL_INVERSE);
             len++;
         }
     }
-
-    // Switch back to normal formatting
-    abAppend(ab, "\x1b[m", 3);
-    // Make room for the status message
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    // <esc>[K clear the message bar
-    abAppend(ab, "\x1b[K", 3);
-    
+void editorDrawMessageBar() {
+    int y = E.screenrows + 1;
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencols) {
         msglen = E.screencols;
     }
     // Show the message only if it's less than 5 seconds old
-    if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        abAppend(ab, E.statusmsg, msglen);
+    int x = 0;
+    if (msglen && time(NULL) - E.statusmsg_time < STATUS_TIMEOUT) {
+        x = screenPut(y, 0, E.statusmsg, msglen, HL_NORMAL, 0);
     }
+    screenClear(y, x);
 }
 
-void editorRefreshScreen() {
-    editorScroll();
+// State of the terminal while a frame is sent, so escapes are only
+// emitted when something actually changes
+struct termState {
+    int y, x; // Cursor position, -1 if unknown
+    int hl; // Color of the text written
+    int attr;
+};
 
-    struct abuf ab = ABUF_INIT;
+void termMove(struct abuf *ab, struct termState *ts, int y, int x) {
+    if (ts->y == y && ts->x == x) {
+        return;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+    ts->y = y;
+    ts->x = x;
+}
 
-    // Hide cursor before refreshing the screen
-    abAppend(&ab, "\x1b[?25l", 6);
-
-    // 4 means we are writing 4 bytes
-    // \x1b is the escape character followed by [
-    // the J command is used to clear the screen:
-    // 0 clear the screen from the cursor up to
-    // the end of the screen
-    // 1 clear the screen up to where the cursor is
-    // 2 clear the entire screen
-    // write(STDOUT_FILENO, "\x1b[2J", 4);
-    // abAppend(&ab, "\x1b[2J", 4);
-
-    // Reposition the cursor at the top-left corner
-    // H command takes two arguments:
-    // row number and column number at which position
-    // the cursor, default values are 1;1.
-    // e.g. 80x24 terminal size and cursor at center
-    // would be \x1b[12;40H
-    // write(STDOUT_FILENO, "\x1b[H", 3);
-    abAppend(&ab, "\x1b[H", 3);
-
-    // Start drawing the "GUI"
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
-    // Move the cursor to the position stored in E.cx / E.cy
-    char buffer[32];
-    snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buffer, strlen(buffer));
+// Escape selecting the color of each highlight class, so they don't
+// have to be formatted again every time the color changes
+struct termEscape {
+    char seq[8];
+    int len;
+} hlEscape[256];
+
+void termInitEscapes() {
+    for (int hl = 0; hl < 256; hl++) {
+        int color = hl == HL_NORMAL ? 39 : editorSyntaxToColor(hl);
+        hlEscape[hl].len = snprintf(hlEscape[hl].seq, sizeof(hlEscape[hl].seq), "\x1b[%dm", color);
+    }
+}
+
+void termSetAttr(struct abuf *ab, struct termState *ts, int hl, int attr) {
+    if (attr != ts->attr) {
+        // <esc>[m resets every attribute, colors included
+        if (attr & CELL_INVERSE) {
+            abAppend(ab, "\x1b[7m", 4);
+        } else {
+            abAppend(ab, "\x1b[m", 3);
+            ts->hl = HL_NORMAL;
+        }
+        ts->attr = attr;
+    }
+    if (hl != ts->hl) {
+        abAppend(ab, hlEscape[hl].seq, hlEscape[hl].len);
+        ts->hl = hl;
+    }
+}
+
+void termScroll(struct abuf *ab, struct termState *ts, int lines) {
+    // Scroll the text rows of the screen by `lines` (up if positive)
+    // inside a scroll region, so the status and message bars stay,
+    // and shift the shadow buffer to match.
+    char buf[32];
+    int n = lines > 0 ? lines : -lines;
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+    abAppend(ab, buf, len);
+    ts->y = -1;
+
+    // Lines scrolled in are blanked with the current colors
+    termSetAttr(ab, ts, HL_NORMAL, 0);
+    if (lines > 0) {
+        // A line feed on the bottom line of the region scrolls it up
+        termMove(ab, ts, E.screenrows - 1, 0);
+        for (int k = 0; k < n; k++) {
+            abAppend(ab, "\n", 1);
+        }
+        memmove(E.shadow, screenRow(E.shadow, n), sizeof(ecell) * E.screencols * (E.screenrows - n));
+    } else {
+        // and a reverse index on the top one scrolls it down
+        termMove(ab, ts, 0, 0);
+        for (int k = 0; k < n; k++) {
+            abAppend(ab, "\x1bM", 2);
+        }
+        memmove(screenRow(E.shadow, n), E.shadow, sizeof(ecell) * E.screencols * (E.screenrows - n));
+    }
+    int first = lines > 0 ? E.screenrows - n : 0;
+    for (int y = first; y < first + n; y++) {
+        ecell *row = screenRow(E.shadow, y);
+        for (int x = 0; x < E.screencols; x++) {
+            row[x].ch = ' ';
+            row[x].hl = HL_NORMAL;
+            row[x].attr = 0;
+        }
+    }
+
+    // Resetting the region also homes the cursor
+    abAppend(ab, "\x1b[r", 3);
+    ts->y = 0;
+    ts->x = 0;
+}
+
+// Unchanged cells between two changed spans are sent again rather
+// than jumping over them, if there are no more than this many.
+#define SCREEN_SPAN_GAP 6
+
+void termDrawSpan(struct abuf *ab, struct termState *ts, int y, int from, int to) {
+    // Send cells from..to-1 of line y. If the line is blank from
+    // some point up to `to`, the end of the line, erase it instead.
+    ecell *row = screenRow(E.screen, y);
+    int end = to;
+    if (to == E.screencols) {
+        while (end > from && row[end - 1].ch == ' ' && row[end - 1].hl == HL_NORMAL && row[end - 1].attr == 0) {
+            end--;
+        }
+    }
+    termMove(ab, ts, y, from);
+    int x = from;
+    while (x < end) {
+        // Send runs of cells of the same color in one go, copying
+        // the chars while looking for the end of the run
+        termSetAttr(ab, ts, row[x].hl, row[x].attr);
+        if (abReserve(ab, end - x) == -1) {
+            break;
+        }
+        char *p = &ab->b[ab->len];
+        int hl = row[x].hl, attr = row[x].attr;
+        int start = x;
+        do {
+            *p++ = row[x++].ch;
+        } while (x < end && row[x].hl == hl && row[x].attr == attr);
+        ab->len += x - start;
+    }
+    ts->x = end;
+    if (end < to) {
+        termSetAttr(ab, ts, HL_NORMAL, 0);
+        abAppend(ab, "\x1b[K", 3);
+    }
+}
+
+int cellSame(const ecell *a, const ecell *b) {
+    return a->ch == b->ch && a->hl == b->hl && a->attr == b->attr;
+}
+
+int screenRowIsAscii(ecell *row) {
+    for (int x = 0; x < E.screencols; x++) {
+        if ((unsigned char)row[x].ch >= 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void editorScreenFlush(struct abuf *ab) {
+    // Send to the terminal whatever differs between the frame just
+    // drawn and the shadow buffer holding what the terminal shows.
+    struct termState ts = { -1, -1, HL_NORMAL, 0 };
+    int lines = E.screenrows + 2;
+
+    if (!E.shadow_valid) {
+        // Clear the screen and send every line whole, there is
+        // nothing to compare with
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        for (int y = 0; y < lines; y++) {
+            termDrawSpan(ab, &ts, y, 0, E.screencols);
+            ts.y = -1;
+        }
+        memcpy(E.shadow, E.screen, sizeof(ecell) * lines * E.screencols);
+        E.shadow_valid = 1;
+        E.shadow_rowoff = E.rowoff;
+        E.shadow_coloff = E.coloff;
+        termSetAttr(ab, &ts, HL_NORMAL, 0);
+        return;
+    } else if (E.coloff == E.shadow_coloff && E.rowoff != E.shadow_rowoff &&
+        abs(E.rowoff - E.shadow_rowoff) < E.screenrows) {
+        termScroll(ab, &ts, E.rowoff - E.shadow_rowoff);
+    }
+    E.shadow_rowoff = E.rowoff;
+    E.shadow_coloff = E.coloff;
+
+    for (int y = 0; y < lines; y++) {
+        ecell *now = screenRow(E.screen, y);
+        ecell *was = screenRow(E.shadow, y);
+        if (!memcmp(now, was, sizeof(ecell) * E.screencols)) {
+            continue;
+        }
+
+        // Multi-byte chars don't take one column each: send lines
+        // holding any of them from the start, as a whole.
+        if (!screenRowIsAscii(now) || !screenRowIsAscii(was)) {
+            termDrawSpan(ab, &ts, y, 0, E.screencols);
+            ts.y = -1;
+            memcpy(was, now, sizeof(ecell) * E.screencols);
+            continue;
+        }
+
+        int x = 0;
+        while (x < E.screencols) {
+            if (cellSame(&now[x], &was[x])) {
+                x++;
+                continue;
+            }
+            int from = x, to = x + 1, same = 0;
+            for (x = to; x < E.screencols && same <= SCREEN_SPAN_GAP; x++) {
+                if (!cellSame(&now[x], &was[x])) {
+                    to = x + 1;
+                    same = 0;
+                } else {
+                    same++;
+                }
+            }
+            // Take the rest of the line if that allows erasing it
+            if (to < E.screencols) {
+                int rest = E.screencols - 1;
+                while (rest >= to && now[rest].ch == ' ' && now[rest].hl == HL_NORMAL && now[rest].attr == 0) {
+                    rest--;
+                }
+                if (rest < to) {
+                    to = E.screencols;
+                }
+            }
+            termDrawSpan(ab, &ts, y, from, to);
+            x = to;
+        }
+        memcpy(was, now, sizeof(ecell) * E.screencols);
+    }
+    termSetAttr(ab, &ts, HL_NORMAL, 0);
+}
+
+void editorRefreshScreen() {
+    E.redraw = 0;
+    editorScroll();
 
-    // Show the cursor again
-    abAppend(&ab, "\x1b[?25h", 6);
+    // Draw the "GUI" in the frame buffer
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    abReset(&E.out);
+    editorScreenFlush(&E.out);
+
+    // The frame goes out in one writev(): the cursor is hidden while
+    // the screen is updated (if anything changed at all), then moved
+    // to the position stored in E.cx / E.cy and shown again.
+    char trailer[48];
+    int tlen = snprintf(trailer, sizeof(trailer), "\x1b[%d;%dH%s", (E.cy - E.rowoff) + 1,
+        (E.rx - E.coloff) + 1, E.out.len ? "\x1b[?25h" : "");
+    struct iovec iov[3] = {
+        { "\x1b[?25l", E.out.len ? 6 : 0 },
+        { E.out.b, E.out.len },
+        { trailer, tlen }
+    };
+    E.frame_bytes = iov[0].iov_len + E.out.len + tlen;
+    writeAll(STDOUT_FILENO, iov, 3);
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void editorStatusExpired() {
+    E.redraw = 1;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1207,16 +6600,22 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
     // Get current time
     E.statusmsg_time = time(NULL);
+    // and take the message away when it's too old, even without keys
+    editorTimerAdd(&E.msg_timer, STATUS_TIMEOUT * 1000, editorStatusExpired);
 }
 
-void initEditor() {
+void editorInitState() {
     // This function initialize all the fields of our
-    // editor configuration variable E.
+    // editor configuration variable E, except the screen
+    // size: nothing here needs a terminal.
     E.cx = 0;
     E.cy = 0;
     E.rx = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rowtree = NULL;
+    E.map = NULL;
+    E.maplen = 0;
+    E.map_is_mmap = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.dirty = 0;
@@ -1224,6 +6623,57 @@ void initEditor() {
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL; // No filetype and no syntax highlight
+    editorCharClassInit(&charClassBase, NULL);
+    E.hl_ndirty = 0;
+    E.hl_redraw = 0;
+    E.hl_gen = 1;
+    E.hl_jobs = 0;
+    E.hl_running = 0;
+    E.hl_waiting = 0;
+    E.hl_done = NULL;
+    pthread_mutex_init(&E.hl_lock, NULL);
+    poolInit(sysconf(_SC_NPROCESSORS_ONLN));
+
+    E.screen = NULL;
+    E.shadow = NULL;
+    E.frame_bytes = 0;
+    E.out = (struct abuf)ABUF_INIT;
+    E.inhead = 0;
+    E.intail = 0;
+
+    // Event loop. Resizes aren't watched until initEditor() has
+    // a terminal.
+    E.sigpipe[0] = -1;
+    E.sigpipe[1] = -1;
+    if (pipe(E.workpipe) == -1) {
+        die("editorInitState::pipe");
+    }
+    fcntl(E.workpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.workpipe[1], F_SETFL, O_NONBLOCK);
+    memset(E.timers, 0, sizeof(E.timers));
+    E.timer_tick = editorNow() / TIMER_TICK;
+    E.timer_next = -1;
+    E.msg_timer.armed = 0;
+    E.save = NULL;
+    E.save_running = 0;
+    E.save_timer.armed = 0;
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.group = 1;
+    memset(&E.find, 0, sizeof(E.find));
+    pthread_mutex_init(&E.find.lock, NULL);
+    E.find.cur = -1;
+    E.nidle = 0;
+    E.idle_next = 0;
+    E.redraw = 0;
+    // Highlight the rows off screen in the background
+    editorIdleAdd(editorSyntaxIdlePending, editorSyntaxIdle);
+    termInitEscapes();
+}
+
+void initEditor() {
+    // The editor state, then what comes from the terminal:
+    // its size, and the signal sent when it changes.
+    editorInitState();
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
         die("init::getWindowSize");
@@ -1231,6 +6681,18 @@ void initEditor() {
     // We leave a line for the status bar and one for the
     // status message.
     E.screenrows -= 2;
+
+    if (pipe(E.sigpipe) == -1) {
+        die("initEditor::pipe");
+    }
+    fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleSigwinch;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+    editorScreenResize();
 }
 
 int main(int argc, char *argv[]) {
@@ -1241,11 +6703,18 @@ int main(int argc, char *argv[]) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("Ctrl-Q = Quit :: Ctrl-S = Save :: Ctrl-F = Find");
+    editorSetStatusMessage("Ctrl-Q = Quit :: Ctrl-S = Save :: Ctrl-F = Find :: Ctrl-Z/Y = Undo/Redo");
 
     while (1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        // Apply every key already read (typed ahead, or pasted
+        // without bracketed paste) before drawing again
+        do {
+            editorProcessKeypress();
+            // Scroll after every key, as if it were drawn: where
+            // rowoff ends up depends on the path the cursor took
+            editorScroll();
+        } while (editorInputPending());
     }
     return 0;
 }
@@ -0,0 +1,529 @@
+// Benchmarks for kilo, built with optimizations and run by `make
+// bench`. As in kilo_test.c, kilo.c is compiled in with its main
+// renamed. Inputs are generated, and each benchmark runs in a child
+// process of its own, with a fresh editor. `./kilo_bench scan` runs
+// only the benchmarks named.
+
+#include "alloc_count.h"
+#define main kilo_main
+#include "kilo.c"
+#undef main
+#undef malloc
+#undef realloc
+#undef calloc
+
+#include "fixture.h"
+
+#include <sys/wait.h>
+
+#define BENCH_REPEAT 5 // Runs of each measure, the best one is kept
+
+// Results of the passes that compute nothing else go here, so that
+// the compiler keeps the passes
+volatile long benchSink;
+
+int benchQuiet() {
+    // Send the frames the editor draws to /dev/null. Returns the fd
+    // benchLoud() puts back.
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (saved == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+        die("benchQuiet::dup");
+    }
+    close(null);
+    return saved;
+}
+
+void benchLoud(int saved) {
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+char *benchRepeat(const char *line, size_t len) {
+    // len bytes of line over and over, as a log file would be
+    char *buf = malloc(len);
+    if (buf == NULL) {
+        die("benchRepeat::malloc");
+    }
+    size_t linelen = strlen(line);
+    for (size_t off = 0; off < len; off += linelen) {
+        memcpy(&buf[off], line, off + linelen <= len ? linelen : len - off);
+    }
+    return buf;
+}
+
+void benchScan() {
+    // Line indexing: scanLines() alone, memchr() for comparison, and
+    // editorIndexLines() with the leaves it makes, over a 256 MB log
+    // of 67-byte lines
+    size_t len = (size_t)256 << 20;
+    char *buf = benchRepeat("2024-01-01 12:00:00 INFO request served in 12ms path=/api/v1/items\n", len);
+
+    double scan = 1e30;
+    double chr = 1e30;
+    for (int k = 0; k < BENCH_REPEAT; k++) {
+        double t = fixtureNow();
+        const char *p = buf;
+        int found, cr = 0;
+        while (p < buf + len) {
+            p = scanLines(p, buf + len, ROWS_PER_LEAF, &found, &cr);
+        }
+        t = fixtureNow() - t;
+        scan = t < scan ? t : scan;
+
+        t = fixtureNow();
+        p = buf;
+        while ((p = memchr(p, '\n', buf + len - p))) {
+            p++;
+        }
+        t = fixtureNow() - t;
+        chr = t < chr ? t : chr;
+    }
+
+    E.map = buf;
+    E.maplen = len;
+    double t = fixtureNow();
+    editorIndexLines();
+    t = fixtureNow() - t;
+    printf("scan: scanLines %.1f GB/s, memchr %.1f GB/s, "
+        "editorIndexLines %.1f GB/s on %d threads\n",
+        len / scan / 1e6, len / chr / 1e6, len / t / 1e6, pool.nthreads);
+}
+
+// Lines of C the code benchmarks are made of
+const char *benchCode[] = {
+    "#include <stdio.h>",
+    "",
+    "/* Width of the row up to char cx,",
+    "   with the tabs expanded */",
+    "int editorRowCxToRx(erow *row, int cx) {",
+    "    int rx = 0; // Columns so far",
+    "    for (int j = 0; j < cx; j++) {",
+    "        if (row->chars[j] == '\\t') {",
+    "            rx += (TAB_STOP - 1) - (rx % TAB_STOP);",
+    "        }",
+    "        rx++;",
+    "    }",
+    "    return rx;",
+    "}",
+    "",
+    "static unsigned long hits = 0x1f;",
+    "void report(const char *name, double t) {",
+    "    switch (mode) {",
+    "    case 1: printf(\"%s: %.1f ms\\n\", name, t); break;",
+    "    default: continue;",
+    "    }",
+    "    while (queue != NULL && queue->next) queue = queue->next;",
+    "}",
+};
+
+char *benchCodeText(int nrows, size_t *len) {
+    // nrows lines of C, cycling through benchCode
+    struct abuf ab = ABUF_INIT;
+    int n = sizeof(benchCode) / sizeof(benchCode[0]);
+    for (int j = 0; j < nrows; j++) {
+        abAppend(&ab, benchCode[j % n], strlen(benchCode[j % n]));
+        abAppend(&ab, "\n", 1);
+    }
+    *len = ab.len;
+    return ab.b;
+}
+
+int benchKeywordList(char **keywords, const char *s, int len) {
+    // The keyword lookup the table replaced: every keyword compared
+    // in turn
+    for (int j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) {
+            klen--;
+        }
+        if (klen == len && !strncmp(s, keywords[j], klen)) {
+            return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+    return HL_NORMAL;
+}
+
+void benchKeyword() {
+    // Keyword lookups of every word of 200000 lines of C, with the
+    // hash table and with the list it replaced
+    size_t len;
+    char *text = benchCodeText(200000, &len);
+    E.filename = strdup("bench.c");
+    editorSelectSyntaxHighlight();
+    struct editorSyntax *syn = E.syntax;
+
+    int nwords = 0;
+    int *words = malloc(sizeof(int) * 2 * (len / 2 + 1));
+    for (size_t i = 0; i < len; ) {
+        size_t start = i;
+        while (i < len && (isalnum((unsigned char)text[i]) || text[i] == '_')) {
+            i++;
+        }
+        if (i > start) {
+            words[2 * nwords] = start;
+            words[2 * nwords + 1] = i - start;
+            nwords++;
+        } else {
+            i++;
+        }
+    }
+
+    double table = 1e30;
+    double list = 1e30;
+    int found = 0;
+    for (int k = 0; k < BENCH_REPEAT; k++) {
+        double t = fixtureNow();
+        for (int j = 0; j < nwords; j++) {
+            found += editorKeywordMatch(syn->kwtable, &text[words[2 * j]], words[2 * j + 1]) != HL_NORMAL;
+        }
+        t = fixtureNow() - t;
+        table = t < table ? t : table;
+
+        t = fixtureNow();
+        for (int j = 0; j < nwords; j++) {
+            found -= benchKeywordList(syn->keywords, &text[words[2 * j]], words[2 * j + 1]) != HL_NORMAL;
+        }
+        t = fixtureNow() - t;
+        list = t < list ? t : list;
+    }
+    printf("keyword: %d words, table %.1f ns/word, list %.1f ns/word%s\n", nwords,
+        table * 1e6 / nwords, list * 1e6 / nwords, found ? " (results differ)" : "");
+    free(words);
+    free(text);
+}
+
+void benchHighlight() {
+    // Highlighting 200000 lines of C, loaded beforehand: the colors
+    // of every row, then only the comment state at the end of each
+    size_t len;
+    char *text = benchCodeText(200000, &len);
+    fixtureOpen(text, len, ".c");
+    free(text);
+    for (int j = 0; j < E.numrows; j++) {
+        editorRowView(editorRowAt(j));
+    }
+
+    double colors = 1e30;
+    double states = 1e30;
+    for (int k = 0; k < BENCH_REPEAT; k++) {
+        double t = fixtureNow();
+        int state = 0;
+        for (int j = 0; j < E.numrows; j++) {
+            erow *row = editorRowAt(j);
+            editorUpdateSyntax(row, state, 0, row->size);
+            state = row->hl_open_comment;
+        }
+        t = fixtureNow() - t;
+        colors = t < colors ? t : colors;
+
+        t = fixtureNow();
+        state = 0;
+        for (int j = 0; j < E.numrows; j++) {
+            erow *row = editorRowAt(j);
+            state = editorSyntaxScan(row->chars, row->size, state);
+        }
+        t = fixtureNow() - t;
+        states = t < states ? t : states;
+        benchSink = state;
+    }
+    printf("highlight: %d rows, colors %.0f ns/row, comment state %.1f ms\n",
+        E.numrows, colors * 1e6 / E.numrows, states);
+}
+
+void benchFrameAllocs() {
+    // Allocations per frame on a 300x60 terminal showing C: frames
+    // redrawn whole, frames where only the cursor moves, and frames
+    // scrolled by a row, which load and highlight the row coming in
+    size_t len;
+    char *text = benchCodeText(200000, &len);
+    fixtureOpen(text, len, ".c");
+    free(text);
+    E.screenrows = 58;
+    E.screencols = 300;
+    editorScreenResize();
+
+    int saved = benchQuiet();
+    editorRefreshScreen();
+    int frames = 100;
+    long full = allocCount;
+    for (int j = 0; j < frames; j++) {
+        E.shadow_valid = 0;
+        editorRefreshScreen();
+    }
+    full = allocCount - full;
+    long moves = allocCount;
+    for (int j = 0; j < frames; j++) {
+        E.cy = j % E.screenrows;
+        editorRefreshScreen();
+    }
+    moves = allocCount - moves;
+    long scroll = allocCount;
+    for (int j = 0; j < frames; j++) {
+        E.cy = E.screenrows + j;
+        editorRefreshScreen();
+    }
+    scroll = allocCount - scroll;
+    benchLoud(saved);
+
+    printf("frame allocs: full redraw %.1f, cursor move %.1f, scroll by a row %.1f\n",
+        (double)full / frames, (double)moves / frames, (double)scroll / frames);
+}
+
+void benchRedraw() {
+    // Time to draw a frame on a 400x120 terminal full of C, each row
+    // about as wide as the screen: redrawn whole after the screen was
+    // cleared, and with every cell changed since the last frame
+    int n = sizeof(benchCode) / sizeof(benchCode[0]);
+    struct abuf ab = ABUF_INIT;
+    for (int j = 0; j < 2000; j++) {
+        int start = ab.len;
+        for (int k = j; ab.len - start < 400; k++) {
+            abAppend(&ab, benchCode[k % n], strlen(benchCode[k % n]));
+            abAppend(&ab, " ", 1);
+        }
+        abAppend(&ab, "\n", 1);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    E.screenrows = 118;
+    E.screencols = 400;
+    editorScreenResize();
+
+    int saved = benchQuiet();
+    editorRefreshScreen();
+    int frames = 300;
+    double full = fixtureNow();
+    for (int j = 0; j < frames; j++) {
+        E.shadow_valid = 0;
+        editorRefreshScreen();
+    }
+    full = fixtureNow() - full;
+    int full_bytes = E.frame_bytes;
+    double every = fixtureNow();
+    for (int j = 0; j < frames; j++) {
+        E.cy = j % 2 ? 0 : 1000;
+        E.rowoff = E.cy;
+        editorRefreshScreen();
+    }
+    every = fixtureNow() - every;
+    int every_bytes = E.frame_bytes;
+    benchLoud(saved);
+
+    printf("redraw: full %.0f us/frame (%d bytes), every cell changed %.0f us/frame (%d bytes)\n",
+        full * 1e3 / frames, full_bytes, every * 1e3 / frames, every_bytes);
+}
+
+void benchFind() {
+    // Time to find every match in 2200000 lines of C, the same
+    // query as literal text and as regexes of growing cost
+    size_t len;
+    char *text = benchCodeText(2200000, &len);
+    fixtureOpen(text, len, ".c");
+    free(text);
+
+    struct {
+        int regex;
+        const char *query;
+    } queries[] = {
+        {0, "queue->next"},
+        {1, "queue->next"},
+        {1, "zzzzq"},
+        {1, "queue-.next"},
+        {1, "(printf|report)\\("},
+        {1, "[a-z]+\\[[a-z]\\]"},
+        {1, "[0-9]+\\s*\\)"},
+    };
+    printf("find: %d rows, %.0f MB, %d threads\n", E.numrows, len / 1e6, pool.nthreads);
+    for (unsigned int q = 0; q < sizeof(queries) / sizeof(queries[0]); q++) {
+        double best = 1e30;
+        for (int k = 0; k < BENCH_REPEAT; k++) {
+            E.find.regex = queries[q].regex;
+            double t = fixtureNow();
+            editorFindStart(queries[q].query);
+            editorFindWait(E.find.njobs);
+            t = fixtureNow() - t;
+            best = t < best ? t : best;
+        }
+        printf("  %-7s %-20s %8d matches %6.0f ms\n", queries[q].regex ? "regex" : "literal",
+            queries[q].query, E.find.nmatch, best);
+        editorFindStop(0);
+    }
+}
+
+long benchRss() {
+    // Resident memory in MB, the pages of the file mapping left out
+    long kb = -1;
+    char line[128];
+    FILE *fp = fopen("/proc/self/status", "r");
+    while (fp && fgets(line, sizeof(line), fp)) {
+        sscanf(line, "RssAnon: %ld kB", &kb);
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    return kb / 1024;
+}
+
+void benchMemory() {
+    // Time and memory to open 2000000 lines of C, load every row,
+    // highlight every row and free them all again
+    long base = benchRss();
+    size_t len;
+    char *text = benchCodeText(2000000, &len);
+    double t = fixtureOpen(text, len, ".c");
+    free(text);
+    printf("memory: %d rows, %.0f MB\n", E.numrows, len / 1e6);
+    printf("  open          %6.0f ms  RSS +%ld MB\n", t, benchRss() - base);
+
+    struct rowIter it;
+    t = fixtureNow();
+    for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    }
+    t = fixtureNow() - t;
+    printf("  load all rows %6.0f ms  RSS +%ld MB\n", t, benchRss() - base);
+
+    t = fixtureNow();
+    while (editorSyntaxPending()) {
+        editorSyntaxAdvance(E.numrows, HL_SLICE_ROWS, 0);
+    }
+    for (int j = 0; j < E.numrows; j++) {
+        editorRowHighlight(j);
+    }
+    t = fixtureNow() - t;
+    printf("  highlight all %6.0f ms  RSS +%ld MB\n", t, benchRss() - base);
+
+    t = fixtureNow();
+    for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+        editorFreeRow(row);
+    }
+    t = fixtureNow() - t;
+    printf("  free all rows %6.0f ms\n", t);
+}
+
+void benchSweep() {
+    // Passes over every row of 4000000 lines of C, all loaded, that
+    // only read a few fields of each: the length and first char, as
+    // saving and searching do, the comment state, as the highlighter
+    // does, and building the list of buffers to save
+    size_t len;
+    char *text = benchCodeText(4000000, &len);
+    fixtureOpen(text, len, ".c");
+    free(text);
+    struct rowIter it;
+    for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    }
+
+    double chars = 1e30;
+    double states = 1e30;
+    double save = 1e30;
+    long sum = 0;
+    for (int k = 0; k < BENCH_REPEAT; k++) {
+        double t = fixtureNow();
+        for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+            sum += row->size + (row->size ? row->chars[0] : 0);
+        }
+        t = fixtureNow() - t;
+        chars = t < chars ? t : chars;
+
+        t = fixtureNow();
+        for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+            sum += row->hl_open_comment + row->hl_tf;
+        }
+        t = fixtureNow() - t;
+        states = t < states ? t : states;
+
+        struct saveJob job;
+        memset(&job, 0, sizeof(job));
+        t = fixtureNow();
+        editorSaveSnapshot(&job);
+        t = fixtureNow() - t;
+        save = t < save ? t : save;
+        sum += job.total;
+        free(job.copy);
+        free(job.iov);
+    }
+    benchSink = sum;
+    printf("sweep: %d rows, erow %d bytes: size and chars %.0f ms, comment state %.0f ms, "
+        "save snapshot %.0f ms\n", E.numrows, (int)sizeof(erow), chars, states, save);
+}
+
+void benchUndo() {
+    // Pasting 100000 lines of C in the middle of 1000000, undoing and
+    // redoing the paste, and deleting the same rows one at a time as
+    // undo used to
+    size_t len, plen;
+    char *text = benchCodeText(1000000, &len);
+    fixtureOpen(text, len, ".c");
+    free(text);
+    char *paste = benchCodeText(100000, &plen);
+    E.cy = E.numrows / 2;
+    E.cx = 0;
+
+    editorUndoBoundary(CTRL_KEY('v'));
+    double t = fixtureNow();
+    editorInsertText(paste, plen);
+    double pasted = fixtureNow() - t;
+    free(paste);
+    t = fixtureNow();
+    editorUndo();
+    double undone = fixtureNow() - t;
+    t = fixtureNow();
+    editorRedo();
+    double redone = fixtureNow() - t;
+
+    int at = E.numrows / 2;
+    t = fixtureNow();
+    for (int j = 0; j < 100000; j++) {
+        editorDelRow(at);
+    }
+    double rows = fixtureNow() - t;
+    printf("undo: 100000 of %d rows: paste %.0f ms, undo %.0f ms, redo %.0f ms, "
+        "deleted a row at a time %.0f ms\n", E.numrows + 100000, pasted, undone, redone, rows);
+}
+
+struct bench {
+    const char *name;
+    void (*run)();
+};
+
+struct bench benches[] = {
+    {"scan", benchScan},
+    {"keyword", benchKeyword},
+    {"highlight", benchHighlight},
+    {"allocs", benchFrameAllocs},
+    {"redraw", benchRedraw},
+    {"find", benchFind},
+    {"memory", benchMemory},
+    {"sweep", benchSweep},
+    {"undo", benchUndo},
+};
+
+int main(int argc, char *argv[]) {
+    for (unsigned int j = 0; j < sizeof(benches) / sizeof(benches[0]); j++) {
+        int wanted = argc == 1;
+        for (int k = 1; k < argc; k++) {
+            wanted |= !strcmp(argv[k], benches[j].name);
+        }
+        if (!wanted) {
+            continue;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == -1) {
+            die("main::fork");
+        }
+        if (pid == 0) {
+            fixtureInit();
+            benches[j].run();
+            exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            printf("%s: failed\n", benches[j].name);
+        }
+    }
+    return 0;
+}
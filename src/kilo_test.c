@@ -0,0 +1,1167 @@
+// Tests for kilo, built and run by `make test`. kilo.c is compiled in
+// with its main renamed, so the tests call the editor functions
+// directly, on a buffer with no terminal behind it. Each test runs in
+// a child process of its own, with a fresh editor.
+
+#include "alloc_count.h"
+#define main kilo_main
+#include "kilo.c"
+#undef main
+#undef malloc
+#undef realloc
+#undef calloc
+
+#include "fixture.h"
+
+#include <sys/wait.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        testFailures++; \
+    } \
+} while (0)
+
+void testHighlightAll() {
+    // Move the highlight frontier to the end of the file a slice at a
+    // time, as the idle loop does
+    while (editorSyntaxPending()) {
+        editorSyntaxAdvance(E.numrows, HL_SLICE_ROWS, 0);
+    }
+}
+
+int testColor(int at, int col) {
+    // The color of char col of row `at`, as it would be drawn
+    editorRowHighlight(at);
+    struct rowView *v = editorRowAt(at)->view;
+    int pos = 0;
+    for (int k = 0; k < v->hlruns; k++) {
+        pos += v->hl[k] >> HL_RUN_BITS;
+        if (col < pos) {
+            return v->hl[k] & HL_RUN_COLOR;
+        }
+    }
+    return -1;
+}
+
+void testUnterminatedComment() {
+    // A comment opened at the top of a big file and never closed:
+    // the comment state has to go down half a million rows without
+    // recursing, and no further than the screen before the rest of
+    // the file is left to the idle loop.
+    int nrows = 500000;
+    struct abuf ab = ABUF_INIT;
+    abAppend(&ab, "/* never closed\n", 16);
+    for (int j = 1; j < nrows; j++) {
+        abAppend(&ab, "int x = 1; // not a comment\n", 28);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    CHECK(E.numrows == nrows);
+    CHECK(E.syntax != NULL);
+
+    testHighlightAll();
+    CHECK(editorSyntaxStateAfter(nrows - 1) == 1);
+    CHECK(testColor(nrows / 2, 0) == HL_MLCOMMENT);
+    CHECK(testColor(nrows - 1, 0) == HL_MLCOMMENT);
+
+    // Close the comment: the screen is right at once, the rows
+    // below wait for the idle loop
+    E.cy = 0;
+    E.cx = editorRowAt(0)->size;
+    editorInsertChar('*');
+    editorInsertChar('/');
+    editorSyntaxAdvance(E.screenrows, 1 << 30, 0);
+    CHECK(testColor(1, 0) == HL_KEYWORD2);
+    CHECK(testColor(1, 11) == HL_COMMENT);
+    CHECK(editorSyntaxFrontier() <= E.screenrows);
+    testHighlightAll();
+    CHECK(editorSyntaxStateAfter(nrows - 1) == 0);
+    CHECK(testColor(nrows - 1, 0) == HL_KEYWORD2);
+
+    // Open it again, as if typed at the top
+    editorDelChar();
+    editorDelChar();
+    testHighlightAll();
+    CHECK(editorSyntaxStateAfter(nrows - 1) == 1);
+    CHECK(testColor(nrows - 1, 0) == HL_MLCOMMENT);
+}
+
+void testCheckWorklist() {
+    // The highlighter worklist is sorted, its ranges apart
+    for (int i = 1; i < E.hl_ndirty; i++) {
+        if (E.hl_dirty[i].from <= E.hl_dirty[i - 1].from || E.hl_dirty[i].from < E.hl_dirty[i - 1].to) {
+            fprintf(stderr, "worklist range %d [%d,%d) after [%d,%d)\n", i, E.hl_dirty[i].from,
+                E.hl_dirty[i].to, E.hl_dirty[i - 1].from, E.hl_dirty[i - 1].to);
+            testFailures++;
+            return;
+        }
+    }
+}
+
+void testWorklistCrossed() {
+    // A comment opened above several rows edited since they were last
+    // checked: one bounded pass walks through all of their ranges,
+    // which have to go with it, whether it stops at `until` or at a
+    // leaf a worker is busy with
+    struct abuf ab = ABUF_INIT;
+    for (int j = 0; j < 3 * ROWS_PER_LEAF; j++) {
+        abAppend(&ab, "int x = 1;\n", 11);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    testHighlightAll();
+
+    int edited[] = {10, 20, 30, ROWS_PER_LEAF + 2, ROWS_PER_LEAF + 12};
+    for (unsigned int k = 0; k < sizeof(edited) / sizeof(edited[0]); k++) {
+        editorRowInsertChars(edited[k], 0, " ", 1);
+    }
+    editorRowInsertChars(0, 0, "/*", 2);
+    CHECK(E.hl_ndirty == 6);
+    editorSyntaxAdvance(40, 1 << 30, 0);
+    testCheckWorklist();
+    CHECK(editorSyntaxFrontier() == 40);
+    CHECK(testColor(39, 1) == HL_MLCOMMENT);
+
+    // The leaf after the first is being highlighted by a worker
+    int slot;
+    rowTreeLocate(ROWS_PER_LEAF, &slot)->hl_job = E.hl_gen;
+    editorSyntaxAdvance(E.numrows, 1 << 30, 1);
+    CHECK(E.hl_waiting);
+    testCheckWorklist();
+    CHECK(editorSyntaxFrontier() == ROWS_PER_LEAF);
+
+    rowTreeLocate(ROWS_PER_LEAF, &slot)->hl_job = 0;
+    testHighlightAll();
+    for (int j = 1; j < E.numrows; j++) {
+        if (testColor(j, 1) != HL_MLCOMMENT) {
+            fprintf(stderr, "row %d isn't drawn as a comment\n", j);
+            testFailures++;
+            break;
+        }
+    }
+}
+
+// A copy of the buffer, edited alongside it, for the tests to compare
+// the rows with
+#define TEST_ROWS_MAX 4096
+static char *testRows[TEST_ROWS_MAX];
+static int testNumRows = 0;
+
+void testShadowInsert(int at, const char *s) {
+    memmove(&testRows[at + 1], &testRows[at], sizeof(char *) * (testNumRows - at));
+    testRows[at] = strdup(s);
+    testNumRows++;
+}
+
+void testShadowDelete(int at) {
+    free(testRows[at]);
+    memmove(&testRows[at], &testRows[at + 1], sizeof(char *) * (testNumRows - at - 1));
+    testNumRows--;
+}
+
+void testCheckRows(int near) {
+    // Every row is found where the copy has it, and rows start inside
+    // a comment after a "/*" row until a "*/" row. Rows around `near`
+    // are highlighted first with only the rows above them checked, as
+    // when they are drawn right after an edit.
+    CHECK(E.numrows == testNumRows);
+    for (int j = 0; j < testNumRows && j < E.numrows; j++) {
+        erow *row = editorRowAt(j);
+        if (row->size != (int)strlen(testRows[j]) || memcmp(row->chars, testRows[j], row->size)) {
+            fprintf(stderr, "row %d: '%.*s', expected '%s'\n", j, row->size, row->chars, testRows[j]);
+            testFailures++;
+            return;
+        }
+    }
+
+    int from = near > 2 ? near - 2 : 0;
+    int to = near + 3 < E.numrows ? near + 3 : E.numrows;
+    editorSyntaxAdvance(to, 1 << 30, 0);
+    int state = 0;
+    for (int j = 0; j < to; j++) {
+        if (j >= from && testRows[j][0] == 'r') {
+            int hl = testColor(j, 0);
+            if ((hl == HL_MLCOMMENT) != state) {
+                fprintf(stderr, "row %d highlighted %d after an edit at %d\n", j, hl, near);
+                testFailures++;
+            }
+        }
+        state = strcmp(testRows[j], "/*") ? strcmp(testRows[j], "*/") ? state : 0 : 1;
+    }
+
+    testHighlightAll();
+    state = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        state = strcmp(testRows[j], "/*") ? strcmp(testRows[j], "*/") ? state : 0 : 1;
+        if (editorSyntaxStateAfter(j) != state) {
+            fprintf(stderr, "row %d ends with state %d after an edit at %d\n", j, !state, near);
+            testFailures++;
+            return;
+        }
+    }
+}
+
+int testCheckNode(rowNode *node, int depth, int *leafdepth, int *nleaves) {
+    // Check the counts below node and that it's at least a quarter
+    // full, unless it's the root. Returns its count.
+    if (depth > 0 && rowNodeIsLow(node)) {
+        fprintf(stderr, "node at depth %d holds only %d entries\n", depth, node->n);
+        testFailures++;
+    }
+    if (node->leaf) {
+        CHECK(*leafdepth == -1 || *leafdepth == depth);
+        *leafdepth = depth;
+        (*nleaves)++;
+        CHECK(node->count == node->n);
+        return node->count;
+    }
+    int count = 0;
+    for (int j = 0; j < node->n; j++) {
+        count += testCheckNode(node->child[j], depth + 1, leafdepth, nleaves);
+    }
+    CHECK(node->count == count);
+    return node->count;
+}
+
+void testCheckTree() {
+    // The row tree is balanced, its counts add up, every node but the
+    // root is at least a quarter full and the leaves are all chained
+    int leafdepth = -1, nleaves = 0, chained = 0;
+    CHECK(testCheckNode(E.rowtree, 0, &leafdepth, &nleaves) == E.numrows);
+    for (rowNode *leaf = rowTreeFirstLeaf(); leaf; leaf = leaf->next) {
+        chained++;
+    }
+    CHECK(chained == nleaves);
+    CHECK(nleaves <= E.numrows / (ROWS_PER_LEAF / 4) + 1);
+}
+
+void testLeafBoundaries() {
+    // Insert and delete rows on either side of the places where a
+    // leaf of ROWS_PER_LEAF rows ends, both one at a time and enough
+    // at once to split and merge leaves. Rows don't know their index,
+    // so after each edit the tree has to find every row, the cursor
+    // has to be on the right row and highlighting has to see the
+    // right rows above.
+    E.filename = strdup("leaves.c");
+    editorSelectSyntaxHighlight();
+    char buf[32];
+    for (int j = 0; j < 1000; j++) {
+        int len = snprintf(buf, sizeof(buf), "row %d", j);
+        editorInsertRow(j, buf, len);
+        testShadowInsert(j, buf);
+    }
+    testCheckRows(0);
+
+    int edges[] = {0, 1, ROWS_PER_LEAF - 1, ROWS_PER_LEAF, ROWS_PER_LEAF + 1,
+        2 * ROWS_PER_LEAF - 1, 2 * ROWS_PER_LEAF, 3 * ROWS_PER_LEAF, 998};
+    for (unsigned int k = 0; k < sizeof(edges) / sizeof(edges[0]); k++) {
+        int at = edges[k];
+
+        // Enter at the start of a row, then in the middle of one
+        E.cy = at;
+        E.cx = 0;
+        editorInsertNewline();
+        testShadowInsert(at, "");
+        CHECK(E.cy == at + 1 && E.cx == 0);
+        testCheckRows(at);
+
+        E.cx = 2;
+        editorInsertNewline();
+        testShadowInsert(at + 2, &testRows[at + 1][2]);
+        testRows[at + 1][2] = '\0';
+        CHECK(E.cy == at + 2 && E.cx == 0);
+        testCheckRows(at + 1);
+
+        // Backspace joins them again, then the empty row goes
+        int len = strlen(testRows[at + 1]);
+        editorDelChar();
+        snprintf(buf, sizeof(buf), "%s%s", testRows[at + 1], testRows[at + 2]);
+        testShadowDelete(at + 2);
+        free(testRows[at + 1]);
+        testRows[at + 1] = strdup(buf);
+        CHECK(E.cy == at + 1 && E.cx == len);
+        testCheckRows(at + 1);
+
+        editorDelRow(at);
+        testShadowDelete(at);
+        testCheckRows(at);
+
+        // A comment opened at the edge and closed two leaves further
+        editorInsertRow(at, "/*", 2);
+        testShadowInsert(at, "/*");
+        testCheckRows(at);
+        int end = at + 2 * ROWS_PER_LEAF < E.numrows ? at + 2 * ROWS_PER_LEAF : E.numrows;
+        editorInsertRow(end, "*/", 2);
+        testShadowInsert(end, "*/");
+        testCheckRows(end);
+        editorDelRow(end);
+        testShadowDelete(end);
+        testCheckRows(end);
+        editorDelRow(at);
+        testShadowDelete(at);
+        testCheckRows(at);
+    }
+
+    // Paste enough rows to split leaves, then delete across them so
+    // that they merge
+    struct abuf ab = ABUF_INIT;
+    for (int j = 0; j < 3 * ROWS_PER_LEAF; j++) {
+        int len = snprintf(buf, sizeof(buf), j == 5 ? "/*" : "pasted %d", j);
+        abAppend(&ab, buf, len);
+        abAppend(&ab, "\n", 1);
+        testShadowInsert(ROWS_PER_LEAF - 1 + j, buf);
+    }
+    editorInsertRows(ROWS_PER_LEAF - 1, ab.b, ab.len);
+    free(ab.b);
+    testCheckRows(ROWS_PER_LEAF - 1);
+
+    // Undo brings the deleted rows back where they were
+    char *deleted[3 * ROWS_PER_LEAF];
+    editorUndoBoundary(DEL_KEY);
+    editorDelRows(ROWS_PER_LEAF / 2, 3 * ROWS_PER_LEAF);
+    for (int j = 0; j < 3 * ROWS_PER_LEAF; j++) {
+        deleted[j] = strdup(testRows[ROWS_PER_LEAF / 2]);
+        testShadowDelete(ROWS_PER_LEAF / 2);
+    }
+    testCheckRows(ROWS_PER_LEAF / 2);
+    editorUndo();
+    for (int j = 0; j < 3 * ROWS_PER_LEAF; j++) {
+        testShadowInsert(ROWS_PER_LEAF / 2 + j, deleted[j]);
+        free(deleted[j]);
+    }
+    testCheckRows(ROWS_PER_LEAF / 2 + 3 * ROWS_PER_LEAF);
+    testCheckTree();
+
+    // Delete rows all over the file until only a few are left: leaves
+    // running low merge with or borrow from their neighbours, and so
+    // do the nodes above them, until the root is a single leaf again
+    for (int k = 0; testNumRows > 5; k++) {
+        int at = (int)((k * 7919L) % testNumRows);
+        editorDelRow(at);
+        testShadowDelete(at);
+        testCheckTree();
+        if (k % 100 == 0) {
+            testCheckRows(at);
+        }
+    }
+    testCheckRows(0);
+    CHECK(E.rowtree->leaf);
+}
+
+void testTreeShrink() {
+    // The same with enough rows for nodes between the root and the
+    // leaves, which have to refill too: rows are numbered, so they
+    // have to stay in ascending order
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    int nrows = 3 * ROWS_PER_LEAF * ROWS_FANOUT;
+    for (int j = 0; j < nrows; j++) {
+        int len = snprintf(buf, sizeof(buf), "%d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    editorInsertRows(0, ab.b, ab.len);
+    free(ab.b);
+    testCheckTree();
+
+    for (int k = 0; E.numrows > 5; k++) {
+        editorDelRow((int)((k * 7919L) % E.numrows));
+        if (k % 500 == 0) {
+            testCheckTree();
+        }
+    }
+    testCheckTree();
+    CHECK(E.rowtree->leaf);
+    for (int j = 1; j < E.numrows; j++) {
+        CHECK(atoi(editorRowAt(j - 1)->chars) < atoi(editorRowAt(j)->chars));
+    }
+}
+
+void testEditAllocs() {
+    // Typing, splicing and pasting into a row patch it in place: its
+    // chars and colors only grow, by doubling, so a run of edits
+    // allocates a handful of times, not once or more per key.
+    E.filename = strdup("allocs.c");
+    editorSelectSyntaxHighlight();
+    // Past SLAB_MAX chars, so that the row grows with realloc()
+    const char *code = "\tint foo = bar(1, \"str\"); /* c */ x += 2; if (y) return 0;";
+    struct abuf ab = ABUF_INIT;
+    while (ab.len <= SLAB_MAX) {
+        abAppend(&ab, code, strlen(code));
+    }
+    editorInsertRow(0, ab.b, ab.len);
+    free(ab.b);
+    editorInsertRow(1, "int y;", 6);
+    testHighlightAll();
+    editorRowHighlight(0);
+
+    // Each key is followed by what a redraw does with the row
+    long before = allocCount;
+    E.cy = 0;
+    E.cx = 20;
+    for (int j = 0; j < 1000; j++) {
+        editorInsertChar("ab c;"[j % 5]);
+        editorSyntaxAdvance(E.screenrows, 1 << 30, 0);
+        editorRowHighlight(0);
+        editorRowCxToRx(editorRowAt(0), E.cx);
+    }
+    // The row doubles once; its colors and the undo log may grow
+    CHECK(allocCount - before <= 10);
+
+    // The row has room now: replacing chars allocates nothing
+    before = allocCount;
+    for (int j = 0; j < 1000; j++) {
+        editorRowSplice(0, j % 500, 3, "\"x\"" + j % 2, 2 + j % 2);
+        editorSyntaxAdvance(E.screenrows, 1 << 30, 0);
+        editorRowHighlight(0);
+    }
+    CHECK(allocCount - before == 0);
+
+    // Pasted rows take their chars from the slabs
+    ab = (struct abuf)ABUF_INIT;
+    for (int j = 0; j < 1000; j++) {
+        abAppend(&ab, "\tx = y + 1; // pasted\n", 22);
+    }
+    E.cy = 1;
+    E.cx = 3;
+    before = allocCount;
+    editorInsertText(ab.b, ab.len);
+    // New leaves, slabs and the undo log: about one in 30 rows
+    CHECK(allocCount - before <= 100);
+    free(ab.b);
+    CHECK(E.numrows == 1002);
+}
+
+// Write end of the pipe the keys of testFindEmptyEnter() come from
+static int testKeys = -1;
+
+void testFindLastKey() {
+    // Enter, typed once the prompt has been waiting for a while
+    write(testKeys, "\r", 1);
+}
+
+void testFindEmptyEnter() {
+    // Enter on an empty query leaves the prompt open: the query typed
+    // next still takes the cursor to its first match as it comes in
+    char buf[32];
+    for (int j = 0; j < 100; j++) {
+        int len = snprintf(buf, sizeof(buf), j == 60 ? "the needle" : "row %d", j);
+        editorInsertRow(j, buf, len);
+    }
+
+    int fds[2];
+    int null = open("/dev/null", O_WRONLY);
+    if (pipe(fds) == -1 || null == -1) {
+        die("testFindEmptyEnter::pipe");
+    }
+    dup2(fds[0], STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    testKeys = fds[1];
+    write(testKeys, "\rneedle", 7);
+    struct editorTimer enter = {0};
+    editorTimerAdd(&enter, 200, testFindLastKey);
+
+    editorFind();
+    CHECK(E.cy == 60);
+    CHECK(E.cx == 4);
+    CHECK(E.find.active && E.find.nmatch == 1);
+}
+
+static int testTimerFired = 0;
+
+void testTimerFire() {
+    testTimerFired++;
+}
+
+void testTimers() {
+    // The event loop sleeps until the earliest timer, whichever of
+    // them were added, moved, cancelled or fired since, and timers
+    // more than a turn of the wheel away count as well
+    struct editorTimer a = {0}, b = {0}, c = {0};
+    CHECK(editorTimerNext() == -1);
+    editorTimerAdd(&a, 300, testTimerFire);
+    editorTimerAdd(&b, 100, testTimerFire);
+    editorTimerAdd(&c, 5000, testTimerFire);
+    int next = editorTimerNext();
+    CHECK(next > 50 && next <= 100);
+    editorTimerCancel(&b);
+    next = editorTimerNext();
+    CHECK(next > 250 && next <= 300);
+    editorTimerAdd(&b, 20, testTimerFire);
+    next = editorTimerNext();
+    CHECK(next >= 0 && next <= 20);
+
+    usleep(30000);
+    editorTimerRun();
+    CHECK(testTimerFired == 1);
+    next = editorTimerNext();
+    CHECK(next > 200 && next <= 270);
+    editorTimerAdd(&a, 6000, testTimerFire);
+    next = editorTimerNext();
+    CHECK(next > 4900 && next <= 5000);
+    editorTimerCancel(&c);
+    next = editorTimerNext();
+    CHECK(next > 5900 && next <= 6000);
+    editorTimerCancel(&a);
+    CHECK(editorTimerNext() == -1);
+}
+
+char *testSaveOpen(const char *name, struct stat *st) {
+    // Open a file of 300 numbered lines under /tmp, stat it and
+    // delete its first line. Returns its path, to be freed.
+    char *path = malloc(64);
+    snprintf(path, 64, "/tmp/kilo_test_%d_%s", (int)getpid(), name);
+    FILE *fp = fopen(path, "w");
+    for (int j = 0; fp && j < 300; j++) {
+        fprintf(fp, "line %d\n", j);
+    }
+    if (fp == NULL || fclose(fp) != 0) {
+        die("testSaveOpen::fprintf");
+    }
+    editorOpen(path);
+    stat(path, st);
+    editorDelRow(0);
+    return path;
+}
+
+void testSave() {
+    // Save, and wait for the worker to be done
+    editorSave();
+    poolWait(&E.save_running);
+    editorSaveCollect();
+    CHECK(E.dirty == 0);
+}
+
+int testSaved(const char *path) {
+    // Whether both the file at path and the rows hold lines 1 to 299
+    char expected[8192], got[8192];
+    int len = 0;
+    for (int j = 1; j < 300; j++) {
+        len += snprintf(&expected[len], sizeof(expected) - len, "line %d\n", j);
+    }
+    int fd = open(path, O_RDONLY);
+    int n = fd == -1 ? -1 : read(fd, got, sizeof(got));
+    close(fd);
+    if (n != len || memcmp(got, expected, len)) {
+        return 0;
+    }
+
+    if (E.numrows != 299) {
+        return 0;
+    }
+    for (int j = 0; j < E.numrows; j++) {
+        erow *row = editorRowAt(j);
+        int len = snprintf(expected, sizeof(expected), "line %d", j + 1);
+        if (row->size != len || memcmp(row->chars, expected, len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void testSaveHardLink() {
+    // A file with another link is overwritten, not replaced: both
+    // names see the new text, and the rows the editor hasn't loaded
+    // yet, which point into the file mapping, don't change under it
+    struct stat before, after;
+    char *path = testSaveOpen("link", &before);
+    char other[80];
+    snprintf(other, sizeof(other), "%s.link", path);
+    CHECK(link(path, other) == 0);
+    testSave();
+    CHECK(testSaved(other));
+
+    // Again with only the last row changed: the rest is written back
+    // where the mapping has it
+    editorRowInsertChars(E.numrows - 1, 0, "x", 1);
+    editorRowDelChar(E.numrows - 1, 0);
+    testSave();
+    CHECK(testSaved(other));
+
+    CHECK(stat(path, &after) == 0);
+    CHECK(after.st_ino == before.st_ino && after.st_nlink == 2);
+    unlink(other);
+    unlink(path);
+    free(path);
+}
+
+void testSaveOwner() {
+    // Any other file is replaced by a new one, which gets the mode of
+    // the old one, and its owner and group when we can give them
+    struct stat before, after;
+    char *path = testSaveOpen("owner", &before);
+    CHECK(chmod(path, 0640) == 0);
+    uid_t uid = geteuid() == 0 ? 1234 : before.st_uid;
+    gid_t gid = geteuid() == 0 ? 5678 : before.st_gid;
+    CHECK(chown(path, uid, gid) == 0);
+    testSave();
+    CHECK(testSaved(path));
+
+    CHECK(stat(path, &after) == 0);
+    CHECK(after.st_ino != before.st_ino);
+    CHECK((after.st_mode & 07777) == 0640);
+    CHECK(after.st_uid == uid && after.st_gid == gid);
+    unlink(path);
+    free(path);
+}
+
+void testSleep(void *arg) {
+    // Pool job keeping a worker busy for arg microseconds
+    usleep((useconds_t)(intptr_t)arg);
+}
+
+void testPoolHold(void *after, int usec) {
+    // Keep every worker busy for usec before it takes the jobs queued
+    // after the one run with `after`, or any job when it is NULL
+    pthread_mutex_lock(&pool.lock);
+    struct poolJob **link = &pool.head;
+    if (after) {
+        while (*link && (*link)->arg != after) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            link = &(*link)->next;
+        }
+    }
+    for (int j = 0; j < pool.nthreads; j++) {
+        struct poolJob *job = malloc(sizeof(struct poolJob));
+        job->fn = testSleep;
+        job->arg = (void *)(intptr_t)usec;
+        job->pending = NULL;
+        job->next = *link;
+        if (job->next == NULL) {
+            pool.tail = job;
+        }
+        *link = job;
+        link = &job->next;
+    }
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void testCheckMatches() {
+    // Once the search is over, the index holds every match of the
+    // query in the rows, in order, and nothing else
+    editorFindWait(E.find.njobs);
+    editorFindApplyEdits();
+    const char *q = E.find.query;
+    int qlen = strlen(q);
+    int k = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        erow *row = editorRowAt(j);
+        const char *p = row->chars;
+        const char *m;
+        while ((m = findSubstring(p, row->chars + row->size - p, q, qlen))) {
+            int col = m - row->chars;
+            if (k >= E.find.nmatch || E.find.match[k].row != j || E.find.match[k].col != col) {
+                fprintf(stderr, "match %d: expected row %d col %d, got row %d col %d\n", k, j, col,
+                    k < E.find.nmatch ? E.find.match[k].row : -1, k < E.find.nmatch ? E.find.match[k].col : -1);
+                testFailures++;
+                return;
+            }
+            k++;
+            p = m + qlen;
+        }
+    }
+    CHECK(k == E.find.nmatch);
+}
+
+void testFindLeafEdge() {
+    // Rows are deleted where the last leaf searched by one job meets
+    // the first leaf of the next job, while that job hasn't started.
+    // The leaf running low borrows rows from the next one, the second
+    // time it merges with it: the job of the next leaf has to be back
+    // before that, or it reads rows moved or freed under it.
+    int nleaves = FIND_JOB_LEAVES + ROWS_FANOUT / 2;
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    for (int j = 0; j < nleaves * ROWS_PER_LEAF; j++) {
+        int len = snprintf(buf, sizeof(buf), j % 7 ? "row %d\n" : "needle %d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+
+    // The leaves are full. Splitting FIND_JOB_LEAVES - 1 of them makes
+    // leaf FIND_JOB_LEAVES, the first child of its parent, the last
+    // leaf of the second job.
+    for (int j = FIND_JOB_LEAVES - 2; j >= 0; j--) {
+        editorInsertRow(j * ROWS_PER_LEAF + 1, "row", 3);
+    }
+    int edge = FIND_JOB_LEAVES * ROWS_PER_LEAF + FIND_JOB_LEAVES - 1;
+    int slot;
+    rowNode *leaf = rowTreeFind(edge, &slot);
+    int index = 0;
+    for (rowNode *l = rowTreeFirstLeaf(); l != leaf; l = l->next) {
+        index++;
+    }
+    CHECK(slot == 0 && index == 2 * FIND_JOB_LEAVES - 1);
+
+    for (int pass = 0; pass < 2; pass++) {
+        // Down to a quarter full, so that the next delete refills it.
+        // The second time, the next leaf is made small enough to merge.
+        while (leaf->n > ROWS_PER_LEAF / 4) {
+            editorDelRow(edge);
+        }
+        int next = edge + leaf->n;
+        while (pass == 1 && leaf->next->n > ROWS_PER_LEAF / 4 + 8) {
+            editorDelRow(next);
+        }
+        editorRowAt(next);
+        int merged = leaf->n - 1 + leaf->next->n;
+
+        testPoolHold(NULL, 100000);
+        editorFindStart("needle");
+        CHECK(E.find.njobs == 3);
+        testPoolHold(E.find.jobs[1], 300000);
+        editorDelRow(edge);
+        leaf = rowTreeFind(edge, &slot);
+        CHECK(pass == 0 ? leaf->n > ROWS_PER_LEAF / 4 : leaf->n == merged);
+        testCheckMatches();
+    }
+}
+
+void testFindWrap() {
+    // Stepping back from the first match doesn't wait for the rest of
+    // the file: the cursor goes to the last match once it's in
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    for (int j = 0; j < 2 * FIND_JOB_LEAVES * ROWS_PER_LEAF + 100; j++) {
+        int len = snprintf(buf, sizeof(buf), j % 7 ? "row %d\n" : "needle %d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    int last = (E.numrows - 1) / 7 * 7;
+
+    E.find.open = 1;
+    testPoolHold(NULL, 100000);
+    editorFindStart("needle");
+    CHECK(E.find.njobs == 3);
+    testPoolHold(E.find.jobs[0], 300000);
+    editorFindWait(1);
+    CHECK(E.find.cur == 0 && E.cy == 0);
+    editorFindStep(-1);
+    CHECK(E.find.known < E.find.njobs);
+    CHECK(E.find.wrap && E.cy == 0);
+    CHECK(strstr(E.find.prompt, "wrapping") != NULL);
+
+    editorFindWait(E.find.njobs);
+    CHECK(!E.find.wrap && E.find.cur == E.find.nmatch - 1);
+    CHECK(E.cy == last && E.cx == 0);
+    CHECK(strstr(E.find.prompt, "wrapping") == NULL);
+
+    // Once everything is in, the step back is right away
+    editorFindStep(1);
+    CHECK(E.find.cur == 0);
+    editorFindStep(-1);
+    CHECK(E.cy == last);
+    editorFindStop(0);
+}
+
+void testFindIndex() {
+    // The index of matches follows the rows inserted, deleted and
+    // edited while the search is active: edits made while jobs are
+    // still out move the matches those jobs bring back, later ones
+    // move the matches in the index and replace those of the rows
+    // they change. Several edits in a row share one window of rows
+    // replaced.
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    for (int j = 0; j < 2 * FIND_JOB_LEAVES * ROWS_PER_LEAF + 100; j++) {
+        int len = snprintf(buf, sizeof(buf), j % 7 ? "row %d\n" : "needle %d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+
+    // Edits at the top only wait for the first job
+    testPoolHold(NULL, 100000);
+    editorFindStart("needle");
+    CHECK(E.find.njobs == 3);
+    testPoolHold(E.find.jobs[0], 300000);
+    editorInsertRow(3, "needle needle", 13);
+    editorDelRow(15);
+    editorDelRow(15);
+    editorRowInsertChars(20, 0, "needle", 6);
+    editorInsertRow(40, "no match", 8);
+    CHECK(E.find.known == 1);
+    testCheckMatches();
+
+    // Typing a match at the end of a row, a char at a time
+    E.cy = 100;
+    E.cx = editorRowAt(100)->size;
+    for (const char *p = " needle"; *p; p++) {
+        editorInsertChar(*p);
+    }
+    testCheckMatches();
+
+    // Enter in the middle of a match, then backspace joining it again
+    E.cy = 7;
+    E.cx = 3;
+    editorInsertNewline();
+    testCheckMatches();
+    editorDelChar();
+    testCheckMatches();
+
+    // Rows deleted and inserted around the same place, with no check
+    // in between
+    editorDelRow(200);
+    editorDelRow(199);
+    editorDelRow(199);
+    editorInsertRow(199, "needle", 6);
+    editorInsertRow(201, "needleneedle", 12);
+    editorRowDelChars(201, 0, 3);
+    editorInsertRow(150, "needle", 6);
+    editorRowInsertChars(250, 0, "needle", 6);
+    editorRowInsertChars(251, 0, "needle", 6);
+    testCheckMatches();
+
+    // A paste of several rows, and its undo
+    E.cy = 300;
+    E.cx = 2;
+    editorUndoBoundary(CTRL_KEY('v'));
+    editorInsertText("needle\nx\nneedle needle\n", 24);
+    testCheckMatches();
+    editorUndo();
+    testCheckMatches();
+}
+
+void testRegexMatches(const char *pattern, const char *line, int len, const char *expected) {
+    // The matches of pattern in line, as "start-end" pairs, are the
+    // expected ones, both when the line is a row and when it is in the
+    // text of a leaf not loaded, between other lines
+    struct regex re;
+    struct reDfa d;
+    if (reCompile(&re, pattern) == -1) {
+        fprintf(stderr, "/%s/ doesn't compile: %s\n", pattern, re.err);
+        testFailures++;
+        return;
+    }
+    reDfaInit(&d, &re);
+    struct findJob job;
+    memset(&job, 0, sizeof(job));
+    findRegexLine(&job, &d, 1, line, len);
+
+    struct abuf text = ABUF_INIT;
+    abAppend(&text, "\r\n", 2);
+    abAppend(&text, line, len);
+    abAppend(&text, "\r\n", 2);
+    struct findJob tjob;
+    memset(&tjob, 0, sizeof(tjob));
+    findRegexText(&tjob, &d, 0, text.b, text.len);
+    free(text.b);
+
+    char got[256] = "";
+    int n = 0;
+    for (int k = 0; k < job.nhits; k++) {
+        n += snprintf(&got[n], sizeof(got) - n, "%s%d-%d", k ? " " : "",
+            job.hits[k].col, job.hits[k].col + job.hits[k].len);
+    }
+    if (strcmp(got, expected)) {
+        fprintf(stderr, "/%s/ in '%.*s': %s, expected %s\n", pattern, len, line, got, expected);
+        testFailures++;
+    } else if (tjob.nhits != job.nhits || (job.nhits && memcmp(tjob.hits, job.hits, sizeof(struct findMatch) * job.nhits))) {
+        fprintf(stderr, "/%s/ in '%.*s' found elsewhere in a leaf's text\n", pattern, len, line);
+        testFailures++;
+    }
+    free(job.hits);
+    free(tjob.hits);
+    reDfaFree(&d);
+    reFree(&re);
+}
+
+void testRegex() {
+    // Where the regex search finds matches: the longest one starting
+    // at the leftmost place, then the next one after it. Empty matches
+    // aren't reported.
+    static const char *cases[][3] = {
+        {"cat|dog", "a cat and a dog", "2-5 12-15"},
+        {"ab|abcd|b", "abcd ab b", "0-4 5-7 8-9"},
+        {"a|", "bab", "1-2"},
+        {"[a-c]+", "xxabcaxcz", "2-6 7-8"},
+        {"[^ ]+", "ab  cd", "0-2 4-6"},
+        {"[]a]", "x]a", "1-2 2-3"},
+        {"[\\d_]+", "a1_2b", "1-4"},
+        {"\\s+", "a \tb  ", "1-3 4-6"},
+        {"\\S+", "a \tb  ", "0-1 3-4"},
+        {"\\d+\\.\\d*", "v1.2 and 33.", "1-4 9-12"},
+        {"\\w+", "foo_1 bar", "0-5 6-9"},
+        {"a\\tb", "a\tb", "0-3"},
+        {"\\$\\d", "cost $5", "5-7"},
+        {"ab*c", "ac abc abbbc abx", "0-2 3-6 7-12"},
+        {"a?b+", "bb ab aab", "0-2 3-5 7-9"},
+        {"(ab)+", "abababa", "0-6"},
+        {"(a|b)*c", "xabbac", "1-6"},
+        {"((a|b)c)?d", "acd bd d", "0-3 5-6 7-8"},
+        {"aa", "aaaaa", "0-2 2-4"},
+        {".*", "abc", "0-3"},
+        {"x*", "abc", ""},
+        {"x*", "axxb", "1-3"},
+        {"^", "abc", ""},
+        {"^$", "", ""},
+        {"^foo", "foo foo", "0-3"},
+        {"foo$", "foo foo", "4-7"},
+        {"^foo$", "foo", "0-3"},
+        {"^foo$", "foo ", ""},
+        {"^a|b$", "abab", "0-1 3-4"},
+        {"c+$", "abcc", "2-4"},
+        {"\\s*$", "ab  ", "2-4"},
+        {"b.", "ab", ""},
+        {"[ab]+", "xxab", "2-4"},
+    };
+    for (unsigned int k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+        testRegexMatches(cases[k][0], cases[k][1], strlen(cases[k][1]), cases[k][2]);
+    }
+
+    // "^" only matches the empty string: the line has a match, none
+    // of them gets reported
+    struct regex re;
+    struct reDfa d;
+    CHECK(reCompile(&re, "^") == 0);
+    reDfaInit(&d, &re);
+    CHECK(reSearch(&d, "abc", 3) && d.starts[0] && !d.starts[1]);
+    CHECK(reLongest(&d, "abc", 3, 0) == 0);
+    reDfaFree(&d);
+    reFree(&re);
+
+    // A pattern with more DFA states than are kept: they are dropped
+    // and built again while the line is read
+    char line[4000];
+    unsigned int seed = 1;
+    for (int j = 0; j < (int)sizeof(line); j++) {
+        seed = seed * 1103515245 + 12345;
+        line[j] = seed >> 16 & 1 ? 'a' : 'b';
+    }
+    line[sizeof(line) - 11] = 'a';
+    testRegexMatches("a..........$", line, sizeof(line), "3989-4000");
+
+    const char *bad[] = {"(a", "a)", "*a", "a|*", "[a", "a\\", "[z-a]"};
+    for (unsigned int k = 0; k < sizeof(bad) / sizeof(bad[0]); k++) {
+        if (reCompile(&re, bad[k]) == 0) {
+            fprintf(stderr, "/%s/ compiles\n", bad[k]);
+            testFailures++;
+            reFree(&re);
+        }
+    }
+}
+
+// The numbers the rows of testBulkRows() hold, in order
+static int testNumbers[200000];
+static int testNumNumbers = 0;
+
+void testNumbersSplice(int at, int del, int first, int ins) {
+    // Replace del numbers at `at` with ins numbers from first on
+    memmove(&testNumbers[at + ins], &testNumbers[at + del], sizeof(int) * (testNumNumbers - at - del));
+    for (int j = 0; j < ins; j++) {
+        testNumbers[at + j] = first + j;
+    }
+    testNumNumbers += ins - del;
+}
+
+void testCheckNumbers() {
+    // The rows hold the numbers expected, the tree is sound and the
+    // search index matches the rows
+    CHECK(E.numrows == testNumNumbers);
+    for (int j = 0; j < testNumNumbers && j < E.numrows; j++) {
+        if (atoi(editorRowAt(j)->chars) != testNumbers[j]) {
+            fprintf(stderr, "row %d: %d, expected %d\n", j, atoi(editorRowAt(j)->chars), testNumbers[j]);
+            testFailures++;
+            return;
+        }
+    }
+    if (E.numrows > 0) {
+        testCheckTree();
+    }
+    testCheckMatches();
+}
+
+void testBulkRows() {
+    // Rows inserted and deleted many at a time, as undo and redo of a
+    // paste do, are spliced in and out of the leaves at once: at the
+    // start and the end of the file, across leaves and down to no row
+    // at all, with a search going on
+    int nrows = (2 * FIND_JOB_LEAVES + 10) * ROWS_PER_LEAF;
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    for (int j = 0; j < nrows; j++) {
+        int len = snprintf(buf, sizeof(buf), "%d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    testNumbersSplice(0, 0, 0, nrows);
+
+    testPoolHold(NULL, 100000);
+    editorFindStart("5");
+    testPoolHold(E.find.jobs[0], 300000);
+    editorUndoBoundary(DEL_KEY);
+    editorDelRows(1000, 3000);
+    testNumbersSplice(1000, 3000, 0, 0);
+    testCheckNumbers();
+
+    editorUndo();
+    testNumbersSplice(1000, 0, 1000, 3000);
+    testCheckNumbers();
+    editorRedo();
+    testNumbersSplice(1000, 3000, 0, 0);
+    testCheckNumbers();
+
+    editorDelRows(0, 200);
+    testNumbersSplice(0, 200, 0, 0);
+    editorDelRows(E.numrows - 300, 300);
+    testNumbersSplice(testNumNumbers - 300, 300, 0, 0);
+    testCheckNumbers();
+
+    // Rows pasted at the start, in the middle of a leaf and at the end
+    int at[] = {0, 5000 + ROWS_PER_LEAF / 3, -1};
+    for (int k = 0; k < 3; k++) {
+        int where = at[k] == -1 ? E.numrows : at[k];
+        ab = (struct abuf)ABUF_INIT;
+        for (int j = 0; j < 500; j++) {
+            int len = snprintf(buf, sizeof(buf), "%d\n", 100000 * (k + 1) + j);
+            abAppend(&ab, buf, len);
+        }
+        editorInsertRows(where, ab.b, ab.len);
+        free(ab.b);
+        testNumbersSplice(where, 0, 100000 * (k + 1), 500);
+        testCheckNumbers();
+    }
+
+    editorDelRows(0, E.numrows);
+    testNumbersSplice(0, testNumNumbers, 0, 0);
+    CHECK(E.rowtree == NULL);
+    testCheckNumbers();
+    ab = (struct abuf)ABUF_INIT;
+    for (int j = 0; j < 300; j++) {
+        int len = snprintf(buf, sizeof(buf), "%d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    editorInsertRows(0, ab.b, ab.len);
+    free(ab.b);
+    testNumbersSplice(0, 0, 0, 300);
+    testCheckNumbers();
+}
+
+int testInTree(rowNode *node, rowNode *want) {
+    // Whether want is node or below it
+    if (node == want) {
+        return 1;
+    }
+    for (int j = 0; !node->leaf && j < node->n; j++) {
+        if (testInTree(node->child[j], want)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void testCheckSpliced() {
+    // The tree is sound and the rows hold the numbers expected
+    testCheckTree();
+    struct rowIter it;
+    int j = 0;
+    for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it), j++) {
+        if (j >= testNumNumbers || atoi(row->chars) != testNumbers[j]) {
+            fprintf(stderr, "row %d: %d, expected %d\n", j, atoi(row->chars), testNumbers[j]);
+            testFailures++;
+            return;
+        }
+    }
+    CHECK(j == testNumNumbers);
+}
+
+void testBulkRowsDeep() {
+    // Rows spliced in and out at once three levels down: only the
+    // nodes above the leaves changed are built again, the rest of the
+    // tree stays as it was
+    int nrows = 40 * ROWS_FANOUT * ROWS_PER_LEAF;
+    struct abuf ab = ABUF_INIT;
+    char buf[32];
+    for (int j = 0; j < nrows; j++) {
+        int len = snprintf(buf, sizeof(buf), "%d\n", j);
+        abAppend(&ab, buf, len);
+    }
+    fixtureOpen(ab.b, ab.len, ".c");
+    free(ab.b);
+    testNumbersSplice(0, 0, 0, nrows);
+    rowNode *far = E.rowtree->child[E.rowtree->n - 1];
+    CHECK(!far->leaf && !far->child[0]->leaf);
+
+    // Most of the leaves of one parent go: what is left of it takes
+    // in the parent next to it
+    int leafrows = ROWS_FANOUT * ROWS_PER_LEAF;
+    editorDelRows(leafrows + ROWS_PER_LEAF + 10, leafrows - 5 * ROWS_PER_LEAF);
+    testNumbersSplice(leafrows + ROWS_PER_LEAF + 10, leafrows - 5 * ROWS_PER_LEAF, 0, 0);
+    testCheckSpliced();
+    CHECK(testInTree(E.rowtree, far));
+
+    int del = 3 * leafrows + 77;
+    editorDelRows(100, del);
+    testNumbersSplice(100, del, 0, 0);
+    testCheckSpliced();
+    CHECK(testInTree(E.rowtree, far));
+
+    ab = (struct abuf)ABUF_INIT;
+    for (int j = 0; j < del; j++) {
+        int len = snprintf(buf, sizeof(buf), "%d\n", nrows + j);
+        abAppend(&ab, buf, len);
+    }
+    editorInsertRows(100, ab.b, ab.len);
+    free(ab.b);
+    testNumbersSplice(100, 0, nrows, del);
+    testCheckSpliced();
+    CHECK(testInTree(E.rowtree, far));
+
+    // Down to a couple of leaves, one at each end
+    editorDelRows(50, E.numrows - 100);
+    testNumbersSplice(50, testNumNumbers - 100, 0, 0);
+    testCheckSpliced();
+}
+
+void testRun(const char *name, void (*test)()) {
+    // Run test in a child, so that a crash is only a failed test
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        die("testRun::fork");
+    }
+    if (pid == 0) {
+        // Only this test's failures count
+        testFailures = 0;
+        fixtureInit();
+        test();
+        exit(testFailures ? 1 : 0);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        die("testRun::waitpid");
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("ok   %s\n", name);
+    } else {
+        printf("FAIL %s\n", name);
+        testFailures++;
+    }
+}
+
+int main() {
+    testRun("unterminated comment", testUnterminatedComment);
+    testRun("highlighting across edited rows", testWorklistCrossed);
+    testRun("leaf boundaries", testLeafBoundaries);
+    testRun("row tree shrinking", testTreeShrink);
+    testRun("edit allocations", testEditAllocs);
+    testRun("find after Enter on an empty query", testFindEmptyEnter);
+    testRun("delete at a leaf edge during a search", testFindLeafEdge);
+    testRun("search index under edits", testFindIndex);
+    testRun("find wrapping back", testFindWrap);
+    testRun("rows inserted and deleted at once", testBulkRows);
+    testRun("rows spliced deep in the tree", testBulkRowsDeep);
+    testRun("regex matches", testRegex);
+    testRun("timers", testTimers);
+    testRun("save over a hard link", testSaveHardLink);
+    testRun("save keeps the owner", testSaveOwner);
+    return testFailures ? 1 : 0;
+}